@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Mock carbon server: accepts the Graphite plaintext protocol, checks
+ * each line and reports per flush how many datapoints arrived and how
+ * long after the interval tick the first and last of them did. Lines are
+ * grouped into a flush by their timestamp, which the daemon sets to the
+ * start of the flush, so the latencies are accurate to within a second
+ * while the time taken to receive a flush is exact
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "common.h"
+
+struct sink_interval {
+	long long		 ts;		/* from the lines themselves */
+	unsigned long long	 datapoints;
+	unsigned long long	 bad;
+	unsigned long long	 bytes;
+	struct timeval		 first;
+	struct timeval		 last;
+};
+
+struct sink {
+	struct event_base	*base;
+	struct event		*idle_ev;
+	struct event		*sigint_ev;
+	struct event		*sigterm_ev;
+	struct timeval		 idle;
+	int			 verbose;
+	unsigned long long	 limit;
+
+	struct sink_interval	 cur;
+	int			 active;
+
+	/* Totals over every interval reported */
+	unsigned long long	 intervals;
+	unsigned long long	 datapoints;
+	unsigned long long	 bad;
+	double			 span_sum;
+	double			 span_max;
+	double			 last_sum;
+	double			 last_max;
+};
+
+__dead void	 usage(void);
+int		 sink_line(char *);
+double		 sink_ms(struct timeval *, struct timeval *);
+void		 sink_report(struct sink *);
+void		 sink_read_cb(struct bufferevent *, void *);
+void		 sink_event_cb(struct bufferevent *, short, void *);
+void		 sink_accept_cb(struct evconnlistener *, evutil_socket_t,
+		    struct sockaddr *, int, void *);
+void		 sink_idle_cb(int, short, void *);
+void		 sink_signal_cb(int, short, void *);
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-v] [-i idle] [-n intervals] [-p port]\n",
+	    __progname);
+	exit(1);
+}
+
+/* "<path> <value> <timestamp>", returns the timestamp or -1 */
+int
+sink_line(char *line)
+{
+	char		*path, *value, *ts, *end;
+	long long	 t;
+
+	if ((path = strsep(&line, " ")) == NULL || *path == '\0' ||
+	    (value = strsep(&line, " ")) == NULL || *value == '\0' ||
+	    (ts = strsep(&line, " ")) == NULL || *ts == '\0' ||
+	    line != NULL)
+		return (-1);
+
+	strtod(value, &end);
+	if (*end != '\0')
+		return (-1);
+
+	errno = 0;
+	t = strtoll(ts, &end, 10);
+	if (*end != '\0' || errno || t < 0 || t > INT32_MAX)
+		return (-1);
+
+	return (t);
+}
+
+double
+sink_ms(struct timeval *a, struct timeval *b)
+{
+	return (((a->tv_sec - b->tv_sec) * 1000.0) +
+	    ((a->tv_usec - b->tv_usec) / 1000.0));
+}
+
+void
+sink_report(struct sink *sink)
+{
+	struct sink_interval	*si = &sink->cur;
+	struct timeval		 tick;
+	double			 first, last, span;
+
+	if (!sink->active)
+		return;
+
+	tick.tv_sec = si->ts;
+	tick.tv_usec = 0;
+	first = sink_ms(&si->first, &tick);
+	last = sink_ms(&si->last, &tick);
+	span = sink_ms(&si->last, &si->first);
+
+	printf("%10lld %12llu %8llu %12llu %10.1f %10.1f %10.1f\n", si->ts,
+	    si->datapoints, si->bad, si->bytes, first, last, span);
+	fflush(stdout);
+
+	sink->intervals++;
+	sink->datapoints += si->datapoints;
+	sink->bad += si->bad;
+	sink->span_sum += span;
+	sink->last_sum += last;
+	if (span > sink->span_max)
+		sink->span_max = span;
+	if (last > sink->last_max)
+		sink->last_max = last;
+
+	bzero(si, sizeof(*si));
+	sink->active = 0;
+
+	if (sink->limit && sink->intervals >= sink->limit)
+		event_base_loopbreak(sink->base);
+}
+
+void
+sink_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct sink		*sink = (struct sink *)arg;
+	struct evbuffer		*input = bufferevent_get_input(bev);
+	struct timeval		 now;
+	char			*line;
+	size_t			 len;
+	int			 ts;
+
+	gettimeofday(&now, NULL);
+
+	while ((line = evbuffer_readln(input, &len,
+	    EVBUFFER_EOL_LF)) != NULL) {
+		if ((ts = sink_line(line)) == -1) {
+			if (sink->verbose)
+				warnx("bad line \"%s\"", line);
+			if (sink->active)
+				sink->cur.bad++;
+			else
+				sink->bad++;
+			free(line);
+			continue;
+		}
+		free(line);
+
+		/* A new timestamp means the previous flush is complete */
+		if (sink->active && ts != sink->cur.ts)
+			sink_report(sink);
+		if (!sink->active) {
+			sink->active = 1;
+			sink->cur.ts = ts;
+			sink->cur.first = now;
+		}
+		sink->cur.datapoints++;
+		sink->cur.bytes += len + 1;
+		sink->cur.last = now;
+	}
+
+	/* Report once nothing more has turned up for a while */
+	if (sink->active)
+		evtimer_add(sink->idle_ev, &sink->idle);
+}
+
+void
+sink_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	if (events & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		bufferevent_free(bev);
+}
+
+void
+sink_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *sa, int socklen, void *arg)
+{
+	struct sink		*sink = (struct sink *)arg;
+	struct bufferevent	*bev;
+
+	if ((bev = bufferevent_socket_new(sink->base, fd,
+	    BEV_OPT_CLOSE_ON_FREE)) == NULL) {
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(bev, sink_read_cb, NULL, sink_event_cb, sink);
+	bufferevent_enable(bev, EV_READ);
+}
+
+void
+sink_idle_cb(int fd, short event, void *arg)
+{
+	sink_report((struct sink *)arg);
+}
+
+void
+sink_signal_cb(int sig, short event, void *arg)
+{
+	struct sink	*sink = (struct sink *)arg;
+
+	event_base_loopbreak(sink->base);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sink		 sink;
+	struct evconnlistener	*listener;
+	struct addrinfo		 hints, *res;
+	const char		*port = "2003", *errstr;
+	long long		 ms;
+	int			 c, error;
+
+	bzero(&sink, sizeof(sink));
+	sink.idle.tv_sec = 1;
+
+	while ((c = getopt(argc, argv, "i:n:p:v")) != -1) {
+		switch (c) {
+		case 'i':
+			ms = strtonum(optarg, 1, 60000, &errstr);
+			if (errstr)
+				errx(1, "idle is %s", errstr);
+			sink.idle.tv_sec = ms / 1000;
+			sink.idle.tv_usec = (ms % 1000) * 1000;
+			break;
+		case 'n':
+			sink.limit = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "intervals is %s", errstr);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'v':
+			sink.verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	if (argc > 0)
+		usage();
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(NULL, port, &hints, &res)) != 0)
+		errx(1, "%s", gai_strerror(error));
+
+	if ((sink.base = event_base_new()) == NULL)
+		errx(1, "event_base_new");
+	if ((listener = evconnlistener_new_bind(sink.base, sink_accept_cb,
+	    &sink, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+	    res->ai_addr, res->ai_addrlen)) == NULL)
+		err(1, "listen on port %s", port);
+	freeaddrinfo(res);
+
+	sink.idle_ev = evtimer_new(sink.base, sink_idle_cb, &sink);
+	sink.sigint_ev = evsignal_new(sink.base, SIGINT, sink_signal_cb,
+	    &sink);
+	sink.sigterm_ev = evsignal_new(sink.base, SIGTERM, sink_signal_cb,
+	    &sink);
+	evsignal_add(sink.sigint_ev, NULL);
+	evsignal_add(sink.sigterm_ev, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%10s %12s %8s %12s %10s %10s %10s\n", "timestamp",
+	    "datapoints", "bad", "bytes", "first.ms", "last.ms", "span.ms");
+
+	event_base_dispatch(sink.base);
+
+	/* Anything still arriving counts as a final interval */
+	sink_report(&sink);
+
+	if (sink.intervals > 0)
+		printf("\n%llu intervals, %.1f datapoints each, %llu bad lines,"
+		    " last %.1fms mean %.1fms max, span %.1fms mean "
+		    "%.1fms max\n", sink.intervals,
+		    (double)sink.datapoints / sink.intervals, sink.bad,
+		    sink.last_sum / sink.intervals, sink.last_max,
+		    sink.span_sum / sink.intervals, sink.span_max);
+
+	evconnlistener_free(listener);
+	event_free(sink.idle_ev);
+	event_free(sink.sigint_ev);
+	event_free(sink.sigterm_ev);
+	event_base_free(sink.base);
+
+	return (0);
+}
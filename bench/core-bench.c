@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Microbenchmarks for the parser and aggregator: the cost of parsing a
+ * line, of folding a sample into a statistic both when the statistic is
+ * new and when it already exists, and of taking and summarising a
+ * snapshot, each at a range of cardinalities. With -t the same number of
+ * statistics is spread over that many tag sets instead of names
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "statsd.h"
+
+#define	BENCH_DEFAULT_SAMPLES	1000000
+
+const char	*types[] = { "c", "ms", "g", "s", "h" };
+unsigned long long	 tagsets;
+
+__dead void	 usage(void);
+struct statsd	*bench_env(void);
+void		 bench_env_free(struct statsd *);
+char		*bench_lines(unsigned long long, unsigned long long, size_t *);
+void		 bench_run(unsigned long long, unsigned long long);
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr,
+	    "usage: %s [-n samples] [-t tagsets] [cardinality ...]\n",
+	    __progname);
+	exit(1);
+}
+
+struct statsd *
+bench_env(void)
+{
+	struct statsd	*env;
+
+	if ((env = calloc(1, sizeof(struct statsd))) == NULL)
+		err(1, "calloc");
+	statsd_env_init(env);
+
+	return (env);
+}
+
+void
+bench_env_free(struct statsd *env)
+{
+	struct statistic	*stat;
+
+	while ((stat = RB_ROOT(&env->stats)) != NULL)
+		statistic_delete(env, stat);
+	free(env->tagsets.buckets);
+	free(env);
+}
+
+/* Lines cycle through the types, with the metrics spread out so that
+ * consecutive lines don't hit the same statistic
+ */
+char *
+bench_lines(unsigned long long count, unsigned long long cardinality,
+    size_t *len)
+{
+	char			*buf, *p;
+	unsigned long long	 i, key;
+	size_t			 size;
+
+	size = count * 80;
+	if ((buf = p = malloc(size)) == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < count; i++) {
+		key = (i * 2654435761ULL) % cardinality;
+		if (tagsets)
+			p += snprintf(p, size - (p - buf),
+			    "bench.%s.%llu:%llu|%s|#host:h%llu,env:prod\n",
+			    types[key % 5], key / tagsets, i % 1000,
+			    types[key % 5], key % tagsets);
+		else
+			p += snprintf(p, size - (p - buf),
+			    "bench.%s.%llu:%llu|%s\n", types[key % 5], key,
+			    i % 1000, types[key % 5]);
+	}
+
+	*len = p - buf;
+	return (buf);
+}
+
+void
+bench_run(unsigned long long cardinality, unsigned long long count)
+{
+	struct statsd		*env;
+	struct snapshot		*snap;
+	struct sample		*samples;
+	enum bad_reason		 reason;
+	char			*pristine, *buf, *line, *next;
+	unsigned long long	 i, n = 0, metrics;
+	uint64_t		 t0, parse, insert, update, flush;
+	size_t			 len;
+
+	/* Every key has to turn up for the insert figure to mean much */
+	count = MAX(count, cardinality);
+
+	env = bench_env();
+	pristine = bench_lines(count, cardinality, &len);
+	if ((buf = malloc(len + 1)) == NULL ||
+	    (samples = calloc(count, sizeof(struct sample))) == NULL)
+		err(1, "malloc");
+	memcpy(buf, pristine, len);
+	buf[len] = '\0';
+
+	t0 = hist_now();
+	for (line = buf; *line != '\0'; line = next) {
+		next = line + strcspn(line, "\n");
+		if (*next == '\n')
+			*next++ = '\0';
+		if (sample_parse(line, &samples[n], &reason) == 0)
+			n++;
+	}
+	parse = hist_now() - t0;
+	if (n != count)
+		errx(1, "only parsed %llu of %llu lines", n, count);
+
+	/* The first pass creates each statistic, the second only finds it */
+	t0 = hist_now();
+	for (i = 0; i < n; i++)
+		sample_update(env, &samples[i]);
+	insert = hist_now() - t0;
+
+	t0 = hist_now();
+	for (i = 0; i < n; i++)
+		sample_update(env, &samples[i]);
+	update = hist_now() - t0;
+
+	t0 = hist_now();
+	if ((snap = snapshot_new(env)) == NULL)
+		err(1, "snapshot_new");
+	for (i = 0; i < snap->count; i++)
+		snapshot_summarise(&snap->stats[i]);
+	metrics = snap->count;
+	snapshot_unref(snap);
+	flush = hist_now() - t0;
+
+	printf("%12llu %12llu %12.1f %12.1f %12.1f %12.1f\n", cardinality, n,
+	    (double)parse / n, (double)insert / n, (double)update / n,
+	    (double)flush / metrics);
+
+	free(samples);
+	free(buf);
+	free(pristine);
+	bench_env_free(env);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long	 defaults[] = { 1000, 10000, 100000, 1000000 };
+	unsigned long long	 count = BENCH_DEFAULT_SAMPLES, cardinality;
+	const char		*errstr;
+	size_t			 i;
+	int			 c;
+
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "samples is %s", errstr);
+			break;
+		case 't':
+			tagsets = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "tagsets is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	log_init(1);
+
+	printf("%12s %12s %12s %12s %12s %12s\n", "cardinality", "samples",
+	    "parse.ns", "insert.ns", "update.ns", "flush.ns");
+
+	if (argc == 0)
+		for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+			bench_run(defaults[i], count);
+
+	for (; argc > 0; argc--, argv++) {
+		cardinality = strtonum(*argv, 1, 100000000, &errstr);
+		if (errstr)
+			errx(1, "cardinality is %s", errstr);
+		bench_run(cardinality, count);
+	}
+
+	return (0);
+}
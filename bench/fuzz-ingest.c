@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* libFuzzer target, each input is treated as one packet. The statistics
+ * carry over between inputs so type conflicts and the set and timer
+ * trees get exercised, with a snapshot taken every so often
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+#define	FUZZ_SNAPSHOT_EVERY	1000
+#define	FUZZ_MAX_STATISTICS	100000
+
+int		 LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct statsd	*env;
+	static unsigned long long	 runs;
+	struct statistic	*stat;
+	char			 buf[STATSD_MAX_UDP_PACKET + 1];
+
+	if (size > STATSD_MAX_UDP_PACKET)
+		return (0);
+
+	if (env == NULL) {
+		if ((env = calloc(1, sizeof(struct statsd))) == NULL)
+			abort();
+		statsd_env_init(env);
+		/* Keep the warnings down to a trickle */
+		env->log_limit.rate = 1;
+		env->log_limit.burst = 1;
+		log_init(1);
+	}
+
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+	statsd_ingest(env, NULL, NULL, buf);
+
+	if (++runs % FUZZ_SNAPSHOT_EVERY == 0) {
+		snapshot_unref(snapshot_new(env));
+		if (RB_EMPTY(&env->stats) == 0 &&
+		    env->count[STATSD_COUNTER] + env->count[STATSD_TIMER] +
+		    env->count[STATSD_GAUGE] + env->count[STATSD_SET] +
+		    env->count[STATSD_HISTOGRAM] >
+		    FUZZ_MAX_STATISTICS)
+			while ((stat = RB_ROOT(&env->stats)) != NULL)
+				statistic_delete(env, stat);
+	}
+
+	return (0);
+}
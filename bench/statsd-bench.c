@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Load generator: sends statsd lines over UDP at a fixed rate using
+ * sendmmsg(2) and reports what was sent next to what the daemon says it
+ * received, taken from its internal statistics, and what the kernel
+ * dropped on the receiving socket
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define	BENCH_MAX_PACKET	8192
+#define	BENCH_MAX_BATCH		1024
+#define	BENCH_TYPES		5
+
+enum bench_dist {
+	DIST_UNIFORM = 0,
+	DIST_NORMAL,
+	DIST_EXP
+};
+
+struct bench_type {
+	const char	*suffix;
+	unsigned int	 weight;
+};
+
+struct bench {
+	int			 fd;
+	const char		*prefix;
+	unsigned int		 keys;
+	unsigned int		 lines;
+	size_t			 size;
+	unsigned int		 batch;
+	unsigned long long	 rate;
+	enum bench_dist		 dist;
+	double			 mean;
+	struct bench_type	 types[BENCH_TYPES];
+	unsigned int		 total_weight;
+	uint64_t		 rng;
+
+	/* The daemon's statistics connection, if any */
+	int			 stats_fd;
+	int			 stats_conn;
+	char			 stats_buf[BUFSIZ];
+	size_t			 stats_len;
+	long long		 daemon_rx;
+	unsigned short		 port;
+
+	unsigned long long	 packets;
+	unsigned long long	 sent_lines;
+	unsigned long long	 errors;
+};
+
+__dead void	 usage(void);
+uint64_t	 bench_random(struct bench *);
+double		 bench_uniform(struct bench *);
+double		 bench_value(struct bench *);
+void		 bench_mix(struct bench *, char *);
+size_t		 bench_packet(struct bench *, char *, unsigned int *);
+uint64_t	 bench_now(void);
+void		 bench_sleep(uint64_t);
+unsigned long long	 bench_drops(unsigned short);
+int		 bench_stats_listen(const char *);
+void		 bench_stats_read(struct bench *);
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-b batch] [-d uniform|normal|exp] "
+	    "[-k keys] [-l lines]\n"
+	    "\t[-M mean] [-m mix] [-p port] [-r rate] [-S port] "
+	    "[-s size] [-t seconds]\n"
+	    "\t[-x prefix] [host]\n", __progname);
+	exit(1);
+}
+
+/* xorshift64*, plenty for picking keys and values */
+uint64_t
+bench_random(struct bench *b)
+{
+	b->rng ^= b->rng >> 12;
+	b->rng ^= b->rng << 25;
+	b->rng ^= b->rng >> 27;
+	return (b->rng * 2685821657736338717ULL);
+}
+
+/* In (0, 1] */
+double
+bench_uniform(struct bench *b)
+{
+	return (((bench_random(b) >> 11) + 1) * (1.0 / 9007199254740992.0));
+}
+
+double
+bench_value(struct bench *b)
+{
+	double	 v;
+
+	switch (b->dist) {
+	case DIST_NORMAL:
+		/* Box-Muller, with a tenth of the mean as the deviation */
+		v = sqrt(-2.0 * log(bench_uniform(b))) *
+		    cos(2.0 * M_PI * bench_uniform(b));
+		v = b->mean + (v * b->mean / 10.0);
+		return ((v < 0) ? 0 : v);
+	case DIST_EXP:
+		return (-b->mean * log(bench_uniform(b)));
+	default:
+		return (bench_uniform(b) * 2.0 * b->mean);
+	}
+}
+
+/* Parse a type mix such as "c=70,ms=20,g=5,s=5,h=0" */
+void
+bench_mix(struct bench *b, char *mix)
+{
+	char		*item, *weight;
+	const char	*errstr;
+	int		 i;
+
+	for (i = 0; i < BENCH_TYPES; i++)
+		b->types[i].weight = 0;
+
+	while ((item = strsep(&mix, ",")) != NULL) {
+		if ((weight = strchr(item, '=')) == NULL)
+			errx(1, "bad mix \"%s\"", item);
+		*weight++ = '\0';
+		for (i = 0; i < BENCH_TYPES; i++)
+			if (!strcmp(item, b->types[i].suffix))
+				break;
+		if (i == BENCH_TYPES)
+			errx(1, "unknown type \"%s\"", item);
+		b->types[i].weight = strtonum(weight, 0, 1000, &errstr);
+		if (errstr)
+			errx(1, "weight for %s is %s", item, errstr);
+	}
+
+	for (i = 0, b->total_weight = 0; i < BENCH_TYPES; i++)
+		b->total_weight += b->types[i].weight;
+	if (b->total_weight == 0)
+		errx(1, "mix has no weight");
+}
+
+/* Fill a packet with up to the configured number of lines */
+size_t
+bench_packet(struct bench *b, char *buf, unsigned int *lines)
+{
+	struct bench_type	*t;
+	size_t			 len = 0;
+	unsigned int		 i, w;
+	char			 line[256];
+	int			 n;
+
+	*lines = 0;
+	for (i = 0; i < b->lines; i++) {
+		w = bench_random(b) % b->total_weight;
+		for (t = b->types; w >= t->weight; t++)
+			w -= t->weight;
+
+		if (!strcmp(t->suffix, "s"))
+			n = snprintf(line, sizeof(line), "%s%llu:%llu|s",
+			    b->prefix,
+			    (unsigned long long)(bench_random(b) % b->keys),
+			    (unsigned long long)bench_value(b));
+		else
+			n = snprintf(line, sizeof(line), "%s%llu:%.3f|%s",
+			    b->prefix,
+			    (unsigned long long)(bench_random(b) % b->keys),
+			    bench_value(b), t->suffix);
+		if (n < 0 || (size_t)n >= sizeof(line))
+			continue;
+
+		if (len + n + 1 > b->size && len > 0)
+			break;
+		if (len > 0)
+			buf[len++] = '\n';
+		memcpy(buf + len, line, n);
+		len += n;
+		(*lines)++;
+	}
+
+	return (len);
+}
+
+uint64_t
+bench_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+}
+
+void
+bench_sleep(uint64_t ns)
+{
+	struct timespec	 ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Sum the per-socket drop counters the kernel keeps for anything bound
+ * to the port, only meaningful when the daemon runs on this host. If the
+ * socket can't be found fall back to the system-wide receive buffer
+ * errors, which count the same thing for every UDP socket
+ */
+unsigned long long
+bench_drops(unsigned short port)
+{
+	const char		*files[] = { "/proc/net/udp", "/proc/net/udp6" };
+	FILE			*fp;
+	char			 line[512], *p, *last;
+	unsigned int		 lport;
+	unsigned long long	 drops = 0, v[5];
+	size_t			 i;
+	int			 found = 0;
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		if ((fp = fopen(files[i], "r")) == NULL)
+			continue;
+		/* Skip the header */
+		if (fgets(line, sizeof(line), fp) == NULL) {
+			fclose(fp);
+			continue;
+		}
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			/* "sl local_address:port ..." */
+			if ((p = strchr(line, ':')) == NULL ||
+			    (p = strchr(p + 1, ':')) == NULL ||
+			    sscanf(p + 1, "%x", &lport) != 1 ||
+			    lport != port)
+				continue;
+			/* Drops are the last column */
+			line[strcspn(line, "\n")] = '\0';
+			if ((last = strrchr(line, ' ')) != NULL)
+				drops += strtoull(last + 1, NULL, 10);
+			found = 1;
+		}
+		fclose(fp);
+	}
+
+	if (found || (fp = fopen("/proc/net/snmp", "r")) == NULL)
+		return (drops);
+
+	/* "Udp: InDatagrams NoPorts InErrors OutDatagrams RcvbufErrors" */
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "Udp: %llu %llu %llu %llu %llu", &v[0], &v[1],
+		    &v[2], &v[3], &v[4]) == 5) {
+			drops = v[4];
+			break;
+		}
+	fclose(fp);
+
+	return (drops);
+}
+
+/* Accept the daemon's statistics connection, point its "statistics"
+ * option at this port, so packets.rx can be shown next to what was sent
+ */
+int
+bench_stats_listen(const char *port)
+{
+	struct addrinfo	 hints, *res, *ai;
+	int		 fd = -1, error, on = 1;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((error = getaddrinfo(NULL, port, &hints, &res)) != 0)
+		errx(1, "%s", gai_strerror(error));
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, 1) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1)
+		err(1, "statistics port %s", port);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	return (fd);
+}
+
+void
+bench_stats_read(struct bench *b)
+{
+	char		*line, *end, *value;
+	ssize_t		 n;
+	int		 fd;
+
+	if (b->stats_fd == -1)
+		return;
+
+	if ((fd = accept(b->stats_fd, NULL, NULL)) != -1) {
+		/* The daemon reconnected, drop the old connection */
+		if (b->stats_conn != -1)
+			close(b->stats_conn);
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		b->stats_conn = fd;
+		b->stats_len = 0;
+	}
+	if (b->stats_conn == -1)
+		return;
+
+	for (;;) {
+		if ((n = read(b->stats_conn, b->stats_buf + b->stats_len,
+		    sizeof(b->stats_buf) - b->stats_len - 1)) == 0) {
+			close(b->stats_conn);
+			b->stats_conn = -1;
+			return;
+		}
+		if (n == -1)
+			return;
+		b->stats_len += n;
+		b->stats_buf[b->stats_len] = '\0';
+
+		/* "<prefix>.packets.rx <value> <timestamp>" */
+		for (line = b->stats_buf;
+		    (end = strchr(line, '\n')) != NULL; line = end + 1) {
+			*end = '\0';
+			if ((value = strchr(line, ' ')) == NULL)
+				continue;
+			*value++ = '\0';
+			if (strlen(line) >= 11 &&
+			    !strcmp(line + strlen(line) - 11, ".packets.rx"))
+				b->daemon_rx = strtoll(value, NULL, 10);
+		}
+		b->stats_len = strlen(line);
+		memmove(b->stats_buf, line, b->stats_len);
+		if (b->stats_len == sizeof(b->stats_buf) - 1)
+			b->stats_len = 0;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench		 b;
+	struct addrinfo		 hints, *res;
+	struct mmsghdr		*msgs;
+	struct iovec		*iov;
+	unsigned int		*lines;
+	char			*bufs, port[6] = "8125";
+	const char		*host = "127.0.0.1", *errstr;
+	const char		*stats_port = NULL;
+	char			*mix = NULL;
+	unsigned long long	 duration = 10, drops0, drops, last_packets;
+	unsigned long long	 last_lines;
+	uint64_t		 start, now, due, next_report;
+	unsigned int		 i, n;
+	int			 c, error, sent;
+
+	bzero(&b, sizeof(b));
+	b.prefix = "bench.";
+	b.keys = 1000;
+	b.lines = 1;
+	b.size = 1432;
+	b.batch = 64;
+	b.mean = 100;
+	b.types[0].suffix = "c";
+	b.types[1].suffix = "ms";
+	b.types[2].suffix = "g";
+	b.types[3].suffix = "s";
+	b.types[4].suffix = "h";
+	b.types[0].weight = b.total_weight = 1;
+	b.stats_fd = b.stats_conn = -1;
+	b.daemon_rx = -1;
+	b.rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t)getpid();
+
+	while ((c = getopt(argc, argv, "b:d:k:l:M:m:p:r:S:s:t:x:")) != -1) {
+		switch (c) {
+		case 'b':
+			b.batch = strtonum(optarg, 1, BENCH_MAX_BATCH, &errstr);
+			if (errstr)
+				errx(1, "batch is %s", errstr);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "uniform"))
+				b.dist = DIST_UNIFORM;
+			else if (!strcmp(optarg, "normal"))
+				b.dist = DIST_NORMAL;
+			else if (!strcmp(optarg, "exp"))
+				b.dist = DIST_EXP;
+			else
+				usage();
+			break;
+		case 'k':
+			b.keys = strtonum(optarg, 1, UINT_MAX, &errstr);
+			if (errstr)
+				errx(1, "keys is %s", errstr);
+			break;
+		case 'l':
+			b.lines = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr)
+				errx(1, "lines is %s", errstr);
+			break;
+		case 'M':
+			b.mean = strtonum(optarg, 1, 1000000000, &errstr);
+			if (errstr)
+				errx(1, "mean is %s", errstr);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'p':
+			strtonum(optarg, 1, 65535, &errstr);
+			if (errstr)
+				errx(1, "port is %s", errstr);
+			snprintf(port, sizeof(port), "%s", optarg);
+			break;
+		case 'r':
+			b.rate = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "rate is %s", errstr);
+			break;
+		case 'S':
+			stats_port = optarg;
+			break;
+		case 's':
+			b.size = strtonum(optarg, 64, BENCH_MAX_PACKET, &errstr);
+			if (errstr)
+				errx(1, "size is %s", errstr);
+			break;
+		case 't':
+			duration = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr)
+				errx(1, "duration is %s", errstr);
+			break;
+		case 'x':
+			b.prefix = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		host = argv[0];
+
+	if (mix != NULL)
+		bench_mix(&b, mix);
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((error = getaddrinfo(host, port, &hints, &res)) != 0)
+		errx(1, "%s: %s", host, gai_strerror(error));
+	if ((b.fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) == -1)
+		err(1, "socket");
+	/* Connected so each message needs no address */
+	if (connect(b.fd, res->ai_addr, res->ai_addrlen) == -1)
+		err(1, "connect");
+	b.port = strtonum(port, 1, 65535, NULL);
+	freeaddrinfo(res);
+
+	if (stats_port != NULL)
+		b.stats_fd = bench_stats_listen(stats_port);
+
+	if ((msgs = calloc(b.batch, sizeof(struct mmsghdr))) == NULL ||
+	    (iov = calloc(b.batch, sizeof(struct iovec))) == NULL ||
+	    (lines = calloc(b.batch, sizeof(unsigned int))) == NULL ||
+	    (bufs = calloc(b.batch, BENCH_MAX_PACKET)) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < b.batch; i++) {
+		iov[i].iov_base = bufs + (i * BENCH_MAX_PACKET);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	printf("%8s %12s %12s %12s %12s\n", "seconds", "packets/s",
+	    "lines/s", "daemon.rx", "drops");
+
+	drops0 = bench_drops(b.port);
+	last_packets = last_lines = 0;
+	start = bench_now();
+	next_report = start + 1000000000ULL;
+
+	for (;;) {
+		now = bench_now();
+
+		if (now >= next_report) {
+			bench_stats_read(&b);
+			drops = bench_drops(b.port);
+			printf("%8llu %12llu %12llu %12lld %12llu\n",
+			    (unsigned long long)((now - start) / 1000000000ULL),
+			    b.packets - last_packets,
+			    b.sent_lines - last_lines, b.daemon_rx,
+			    drops - drops0);
+			fflush(stdout);
+			last_packets = b.packets;
+			last_lines = b.sent_lines;
+			next_report += 1000000000ULL;
+			if (now - start >= duration * 1000000000ULL)
+				break;
+		}
+
+		/* Hold back until the next batch is due */
+		n = b.batch;
+		if (b.rate) {
+			due = start + (uint64_t)((b.packets + n) *
+			    (1000000000.0 / b.rate));
+			if (due > now) {
+				bench_sleep(MIN(due - now, next_report - now));
+				continue;
+			}
+		}
+
+		for (i = 0; i < n; i++)
+			iov[i].iov_len = bench_packet(&b, iov[i].iov_base,
+			    &lines[i]);
+
+		if ((sent = sendmmsg(b.fd, msgs, n, 0)) == -1) {
+			/* Nobody listening yet or the socket buffer is full */
+			if (errno != ECONNREFUSED && errno != ENOBUFS &&
+			    errno != EAGAIN && errno != EINTR)
+				err(1, "sendmmsg");
+			b.errors++;
+			sent = 0;
+		}
+		b.packets += sent;
+		for (i = 0; i < (unsigned int)sent; i++)
+			b.sent_lines += lines[i];
+	}
+
+	/* Pick up anything the daemon reported since the last tick */
+	bench_stats_read(&b);
+
+	now = bench_now();
+	printf("\nsent %llu packets, %llu lines in %.3fs, %.0f packets/s, "
+	    "%llu send errors\n", b.packets, b.sent_lines,
+	    (now - start) / 1e9, b.packets / ((now - start) / 1e9), b.errors);
+	printf("kernel dropped %llu packets\n", bench_drops(b.port) - drops0);
+	if (b.daemon_rx >= 0)
+		printf("daemon last reported packets.rx %lld\n", b.daemon_rx);
+
+	free(bufs);
+	free(lines);
+	free(iov);
+	free(msgs);
+	close(b.fd);
+
+	return (0);
+}
@@ -22,6 +22,7 @@
 #include <sys/queue.h>
 #include <sys/time.h>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <netdb.h>
 
@@ -44,9 +45,23 @@
 #define	__dead
 #endif
 
+struct log_limit {
+	unsigned int		 rate;		/* messages per second */
+	unsigned int		 burst;
+	double			 tokens;
+	uint64_t		 last;
+	unsigned long long	 suppressed;
+	unsigned long long	 total;
+};
+
 /* prototypes */
 /* log.c */
+extern unsigned long long	 log_dropped;
 void		 log_init(int);
+void		 log_async_start(void);
+void		 log_forked(void);
+int		 log_limit_pass(struct log_limit *);
+void		 log_warnx_limit(struct log_limit *, const char *, ...);
 void		 vlog(int, const char *, va_list);
 void		 log_warn(const char *, ...);
 void		 log_warnx(const char *, ...);
@@ -15,18 +15,54 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 
-int	 debug;
+/* Messages waiting for the log thread. Any thread can add one without
+ * taking a lock, claiming a slot by bumping the head. Each slot's
+ * sequence number says whether it is free for the round of the ring the
+ * writer is on or holds a message for the reader. A full ring drops the
+ * message rather than wait. The log thread sleeps on a condition
+ * variable once the ring is empty, and a writer only takes the lock to
+ * wake it if it says it is asleep
+ */
+#define	LOG_RING_SIZE		256	/* power of two */
+#define	LOG_MSG_SIZE		512
+
+struct log_slot {
+	uint64_t		 seq;
+	int			 pri;
+	char			 msg[LOG_MSG_SIZE];
+};
+
+int			 debug;
+
+static struct log_slot	 log_ring[LOG_RING_SIZE];
+static uint64_t		 log_head;
+static uint64_t		 log_tail;
+static int		 log_async;
+static pthread_t	 log_tid;
+static pthread_mutex_t	 log_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 log_cond = PTHREAD_COND_INITIALIZER;
+static int		 log_waiting;
+static int		 log_stop;
+unsigned long long	 log_dropped;
 
 void	 logit(int, const char *, ...);
+void	 log_write(int, const char *);
+int	 log_pending(void);
+int	 log_drain(void);
+void	 log_drain_exit(void);
+void	*log_thread(void *);
 
 void
 log_init(int n_debug)
@@ -51,10 +87,159 @@ logit(int pri, const char *fmt, ...)
 	va_end(ap);
 }
 
+void
+log_write(int pri, const char *msg)
+{
+	if (debug) {
+		fprintf(stderr, "%s\n", msg);
+		fflush(stderr);
+	} else
+		syslog(pri, "%s", msg);
+}
+
+int
+log_pending(void)
+{
+	return (__atomic_load_n(&log_ring[log_tail &
+	    (LOG_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == log_tail + 1);
+}
+
+/* Write out everything queued, returns how many messages there were. Only
+ * one thread at a time may do this
+ */
+int
+log_drain(void)
+{
+	struct log_slot	*slot;
+	int		 n = 0;
+
+	for (;;) {
+		slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    log_tail + 1)
+			break;
+		log_write(slot->pri, slot->msg);
+		__atomic_store_n(&slot->seq, log_tail + LOG_RING_SIZE,
+		    __ATOMIC_RELEASE);
+		log_tail++;
+		n++;
+	}
+
+	return (n);
+}
+
+/* A forked child has no log thread so writes its own messages */
+void
+log_forked(void)
+{
+	log_async = 0;
+}
+
+/* Stop the log thread so it isn't still draining the ring alongside us,
+ * then write out whatever explains why we're exiting
+ */
+void
+log_drain_exit(void)
+{
+	if (!log_async)
+		return;
+
+	pthread_mutex_lock(&log_mtx);
+	log_stop = 1;
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mtx);
+	pthread_join(log_tid, NULL);
+
+	log_async = 0;
+	log_drain();
+}
+
+void *
+log_thread(void *arg)
+{
+	int	 stop;
+
+	for (;;) {
+		if (log_drain() > 0)
+			continue;
+
+		pthread_mutex_lock(&log_mtx);
+		__atomic_store_n(&log_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (!log_stop && !log_pending())
+			pthread_cond_wait(&log_cond, &log_mtx);
+		__atomic_store_n(&log_waiting, 0, __ATOMIC_RELAXED);
+		stop = log_stop;
+		pthread_mutex_unlock(&log_mtx);
+
+		if (stop)
+			break;
+	}
+
+	return (NULL);
+}
+
+/* Hand every message to a thread of its own so a slow syslog never holds
+ * up the caller
+ */
+void
+log_async_start(void)
+{
+	int	 i;
+
+	if (log_async)
+		return;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	log_head = log_tail = 0;
+
+	if (pthread_create(&log_tid, NULL, log_thread, NULL) != 0)
+		return;
+	atexit(log_drain_exit);
+	log_async = 1;
+}
+
 void
 vlog(int pri, const char *fmt, va_list ap)
 {
-	char	*nfmt;
+	struct log_slot	*slot;
+	uint64_t	 pos, seq;
+	char		*nfmt;
+
+	if (log_async) {
+		pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		for (;;) {
+			slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq == pos) {
+				if (__atomic_compare_exchange_n(&log_head,
+				    &pos, pos + 1, 0, __ATOMIC_RELAXED,
+				    __ATOMIC_RELAXED))
+					break;
+			} else if (seq < pos) {
+				/* Full */
+				__sync_add_and_fetch(&log_dropped, 1);
+				return;
+			} else
+				pos = __atomic_load_n(&log_head,
+				    __ATOMIC_RELAXED);
+		}
+		slot->pri = pri;
+		vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+		/* Pairs with the fence in log_thread(), either it sees
+		 * this message or we see that it is waiting
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&log_waiting, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&log_mtx);
+			pthread_cond_signal(&log_cond);
+			pthread_mutex_unlock(&log_mtx);
+		}
+		return;
+	}
 
 	if (debug) {
 		/* best effort in out of mem situations */
@@ -114,6 +299,59 @@ log_info(const char *emsg, ...)
 	va_end(ap);
 }
 
+/* Token bucket, a message is only logged if there's a token for it. The
+ * tokens are topped up at the configured rate, up to the burst size, and
+ * the number of messages suppressed meanwhile is logged with the next
+ * one that gets through. Not safe to share between threads
+ */
+int
+log_limit_pass(struct log_limit *ll)
+{
+	struct timespec	 ts;
+	uint64_t	 now;
+	unsigned long long	 suppressed;
+
+	if (ll->rate == 0)
+		return (1);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	if (ll->last == 0)
+		ll->tokens = ll->burst;
+	else
+		ll->tokens += (double)(now - ll->last) * ll->rate / 1e9;
+	if (ll->tokens > ll->burst)
+		ll->tokens = ll->burst;
+	ll->last = now;
+
+	if (ll->tokens < 1) {
+		ll->suppressed++;
+		ll->total++;
+		return (0);
+	}
+	ll->tokens--;
+
+	if ((suppressed = ll->suppressed) > 0) {
+		ll->suppressed = 0;
+		logit(LOG_CRIT, "%llu messages suppressed", suppressed);
+	}
+
+	return (1);
+}
+
+void
+log_warnx_limit(struct log_limit *ll, const char *emsg, ...)
+{
+	va_list	 ap;
+
+	if (!log_limit_pass(ll))
+		return;
+
+	va_start(ap, emsg);
+	vlog(LOG_CRIT, emsg, ap);
+	va_end(ap);
+}
+
 void
 log_debug(const char *emsg, ...)
 {
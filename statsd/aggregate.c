@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* An aggregate is an ordinary untagged statistic that other statistics
+ * are folded into just before each snapshot: counters are summed, gauges
+ * summed or the largest taken, timer readings and set values merged and
+ * histogram buckets added up. Which aggregate a statistic belongs to is
+ * worked out once when it is created, so the flush only walks the
+ * members of each aggregate. An aggregate never belongs to another one
+ */
+void		 aggregate_value(struct statistic *, struct statistic *,
+		    enum aggregate_op, int);
+void		 aggregate_timer(struct statsd *, struct statistic *,
+		    struct statistic *, int);
+void		 aggregate_set(struct statsd *, struct statistic *,
+		    struct statistic *, int);
+void		 aggregate_histogram(struct statistic *, struct statistic *,
+		    int);
+
+/* Find or create the aggregate a new statistic belongs to, if any */
+void
+aggregate_join(struct statsd *env, struct statistic *stat)
+{
+	struct statistic	*target;
+	struct statistic	 find;
+	struct rule		*r;
+	char			 name[STATSD_MAX_UDP_PACKET];
+
+	if (stat->derived || env->aggregate_root == NULL ||
+	    (r = rule_find(env, env->aggregate_root, stat->metric, name,
+	    sizeof(name))) == NULL)
+		return;
+
+	/* Tagged series can be aggregated under their own name */
+	if (stat->tags == NULL && !strcmp(stat->metric, name))
+		return;
+
+	find.metric = name;
+	find.tags = NULL;
+	if ((target = RB_FIND(statistics, &env->stats, &find)) == NULL) {
+		if (env->max_memory && statsd_memory(env) >= env->max_memory) {
+			env->memory_refused++;
+			return;
+		}
+		if ((target = statistic_new(env, name, NULL,
+		    stat->type)) == NULL) {
+			log_warn("statistic_new");
+			return;
+		}
+	}
+	if (target->type != stat->type || target->aggregate != NULL)
+		return;
+
+	if (target->rule == NULL) {
+		target->rule = r;
+		target->derived = 1;
+		TAILQ_INSERT_TAIL(&env->aggregates, target, member_entry);
+	}
+	stat->aggregate = target;
+	TAILQ_INSERT_TAIL(&target->members, stat, member_entry);
+}
+
+/* A statistic is being deleted, an aggregate's members stay as they are
+ * but no longer feed anything
+ */
+void
+aggregate_leave(struct statsd *env, struct statistic *stat)
+{
+	struct statistic	*member;
+
+	if (stat->aggregate != NULL) {
+		TAILQ_REMOVE(&stat->aggregate->members, stat, member_entry);
+		stat->aggregate = NULL;
+	}
+	if (stat->rule != NULL) {
+		while ((member = TAILQ_FIRST(&stat->members)) != NULL) {
+			TAILQ_REMOVE(&stat->members, member, member_entry);
+			member->aggregate = NULL;
+		}
+		TAILQ_REMOVE(&env->aggregates, stat, member_entry);
+		stat->rule = NULL;
+	}
+}
+
+/* Work out every statistic's aggregate again after the rules have been
+ * reloaded. The old rules are already gone so they are only cleared
+ */
+void
+aggregate_index(struct statsd *env)
+{
+	struct statistic	*target, *member, *stat;
+
+	while ((target = TAILQ_FIRST(&env->aggregates)) != NULL) {
+		while ((member = TAILQ_FIRST(&target->members)) != NULL) {
+			TAILQ_REMOVE(&target->members, member, member_entry);
+			member->aggregate = NULL;
+		}
+		TAILQ_REMOVE(&env->aggregates, target, member_entry);
+		target->rule = NULL;
+		target->derived = 0;
+	}
+
+	if (env->aggregate_root == NULL)
+		return;
+
+	/* Any aggregate created along the way is derived so is skipped */
+	RB_FOREACH(stat, statistics, &env->stats)
+		aggregate_join(env, stat);
+}
+
+void
+aggregate_value(struct statistic *target, struct statistic *member,
+    enum aggregate_op op, int first)
+{
+	long double	 v = member->value.count;
+
+	/* A gauge is worked out from scratch each time but a counter may
+	 * have had samples of its own
+	 */
+	if (target->type == STATSD_GAUGE && first)
+		target->value.count = v;
+	else if (op == AGGREGATE_SUM)
+		target->value.count += v;
+	else
+		target->value.count = MAX(target->value.count, v);
+
+	if (member->type == STATSD_COUNTER && target->rule->suppress)
+		member->value.count = 0;
+}
+
+/* Readings are copied, or moved if the member isn't sent itself */
+void
+aggregate_timer(struct statsd *env, struct statistic *target,
+    struct statistic *member, int move)
+{
+	struct reading		*r, *next, *found;
+
+	for (r = RB_MIN(readings, &member->value.timer.readings); r != NULL;
+	    r = next) {
+		next = RB_NEXT(readings, &member->value.timer.readings, r);
+		if ((found = RB_FIND(readings, &target->value.timer.readings,
+		    r)) != NULL) {
+			found->count += r->count;
+			if (move) {
+				RB_REMOVE(readings,
+				    &member->value.timer.readings, r);
+				statistic_shrink(env, member, READING_SIZE);
+				free(r);
+			}
+			continue;
+		}
+		if (move) {
+			RB_REMOVE(readings, &member->value.timer.readings, r);
+			statistic_shrink(env, member, READING_SIZE);
+			found = r;
+		} else if ((found = malloc(sizeof(struct reading))) == NULL) {
+			log_warn("malloc");
+			break;
+		} else
+			*found = *r;
+		RB_INSERT(readings, &target->value.timer.readings, found);
+		statistic_grow(env, target, READING_SIZE);
+	}
+
+	target->value.timer.count += member->value.timer.count;
+	if (move)
+		member->value.timer.count = 0;
+}
+
+void
+aggregate_set(struct statsd *env, struct statistic *target,
+    struct statistic *member, int move)
+{
+	struct unique		*u, *next, *copy;
+
+	for (u = RB_MIN(uniques, &member->value.uniques); u != NULL;
+	    u = next) {
+		next = RB_NEXT(uniques, &member->value.uniques, u);
+		if (move) {
+			RB_REMOVE(uniques, &member->value.uniques, u);
+			statistic_shrink(env, member, UNIQUE_SIZE(u));
+		}
+		if (RB_FIND(uniques, &target->value.uniques, u) != NULL) {
+			if (move) {
+				free(u->value);
+				free(u);
+			}
+			continue;
+		}
+		if (move)
+			copy = u;
+		else if ((copy = calloc(1, sizeof(struct unique))) == NULL ||
+		    (copy->value = strdup(u->value)) == NULL) {
+			log_warn("calloc");
+			free(copy);
+			break;
+		}
+		RB_INSERT(uniques, &target->value.uniques, copy);
+		statistic_grow(env, target, UNIQUE_SIZE(copy));
+	}
+}
+
+/* Each of the member's buckets is added to the aggregate's bucket that
+ * holds its upper bound, which is exact when they have the same bounds
+ */
+void
+aggregate_histogram(struct statistic *target, struct statistic *member,
+    int move)
+{
+	size_t		 i, j, n = member->value.histogram.nbounds;
+
+	for (i = 0; i <= n; i++) {
+		j = (i < n) ? histogram_bucket(target->value.histogram.bounds,
+		    target->value.histogram.nbounds,
+		    member->value.histogram.bounds[i]) :
+		    target->value.histogram.nbounds;
+		target->value.histogram.counts[j] +=
+		    member->value.histogram.counts[i];
+	}
+	target->value.histogram.count += member->value.histogram.count;
+	target->value.histogram.sum += member->value.histogram.sum;
+
+	if (move) {
+		bzero(member->value.histogram.counts,
+		    (n + 1) * sizeof(unsigned long long));
+		member->value.histogram.count = 0;
+		member->value.histogram.sum = 0;
+	}
+}
+
+/* Fold every member into its aggregate ahead of taking the snapshot */
+void
+aggregate_flush(struct statsd *env)
+{
+	struct statistic	*target, *member;
+	int			 first;
+
+	TAILQ_FOREACH(target, &env->aggregates, member_entry) {
+		first = 1;
+		TAILQ_FOREACH(member, &target->members, member_entry) {
+			switch (target->type) {
+			case STATSD_COUNTER:
+				/* FALLTHROUGH */
+			case STATSD_GAUGE:
+				aggregate_value(target, member,
+				    target->rule->op, first);
+				break;
+			case STATSD_TIMER:
+				aggregate_timer(env, target, member,
+				    target->rule->suppress);
+				break;
+			case STATSD_SET:
+				aggregate_set(env, target, member,
+				    target->rule->suppress);
+				break;
+			case STATSD_HISTOGRAM:
+				aggregate_histogram(target, member,
+				    target->rule->suppress);
+				break;
+			default:
+				break;
+			}
+			if (timercmp(&member->tv, &target->tv, >))
+				target->tv = member->tv;
+			first = 0;
+		}
+	}
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "statsd.h"
+
+/* A capture is every datagram received, as received, so it can be fed
+ * back through the parser later. Like the checkpoint it is stored in
+ * native byte order.
+ *
+ *	header:	magic[8] version:u32 reserved:u32
+ *	record:	usec:u64 len:u16 family:u8 pad:u8 addr[0|4|16] data[len]
+ *
+ * When replaying, the time of each record drives a virtual clock so
+ * intervals are flushed at the same points in the traffic every run, no
+ * matter how quickly the records are read
+ */
+#define	CAPTURE_MAGIC		"EVSTCAPT"
+#define	CAPTURE_VERSION		1
+#define	CAPTURE_BUFFER		(1024 * 1024)
+
+/* How many records to replay before letting the event loop run */
+#define	REPLAY_BATCH		1024
+
+struct capture_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 reserved;
+};
+
+struct capture_record {
+	uint64_t	 usec;
+	uint16_t	 len;
+	uint8_t		 family;
+	uint8_t		 pad;
+};
+
+struct replay {
+	char		*map;
+	size_t		 size;
+	size_t		 off;
+	int		 paced;
+	int		 started;
+	struct event	*ev;
+	struct event	*start_ev;
+
+	uint64_t	 first;		/* capture time of the first record */
+	uint64_t	 next_tick;	/* capture time of the next flush */
+	uint64_t	 real_start;	/* when replaying began */
+	unsigned long long	 packets;
+	unsigned long long	 intervals;
+};
+
+static struct replay	 replay;
+
+void		 replay_tick(struct statsd *, uint64_t);
+void		 replay_finish(struct statsd *);
+void		 replay_cb(int, short, void *);
+void		 replay_start_cb(int, short, void *);
+void		 replay_drain_cb(int, short, void *);
+
+int
+capture_open(struct statsd *env, const char *path)
+{
+	struct capture_header	 ch;
+
+	if ((env->capture = fopen(path, "w")) == NULL) {
+		log_warn("%s", path);
+		return (-1);
+	}
+	setvbuf(env->capture, NULL, _IOFBF, CAPTURE_BUFFER);
+
+	bzero(&ch, sizeof(ch));
+	memcpy(ch.magic, CAPTURE_MAGIC, sizeof(ch.magic));
+	ch.version = CAPTURE_VERSION;
+	if (fwrite(&ch, sizeof(ch), 1, env->capture) != 1) {
+		log_warn("%s", path);
+		fclose(env->capture);
+		env->capture = NULL;
+		return (-1);
+	}
+
+	log_info("capturing packets to %s", path);
+
+	return (0);
+}
+
+/* Called for every datagram so it only ever appends to the buffer, the
+ * write to disk happens whenever that fills up and at exit
+ */
+void
+capture_packet(struct statsd *env, struct sockaddr_storage *ss,
+    const char *buf, size_t len)
+{
+	struct capture_record	 cr;
+	struct timeval		 tv;
+
+	gettimeofday(&tv, NULL);
+
+	bzero(&cr, sizeof(cr));
+	cr.usec = ((uint64_t)tv.tv_sec * 1000000ULL) + tv.tv_usec;
+	cr.len = len;
+	if (ss->ss_family == AF_INET || ss->ss_family == AF_INET6)
+		cr.family = ss->ss_family;
+	else
+		cr.family = AF_UNSPEC;
+
+	fwrite(&cr, sizeof(cr), 1, env->capture);
+	switch (cr.family) {
+	case AF_INET:
+		fwrite(&((struct sockaddr_in *)ss)->sin_addr,
+		    sizeof(struct in_addr), 1, env->capture);
+		break;
+	case AF_INET6:
+		fwrite(&((struct sockaddr_in6 *)ss)->sin6_addr,
+		    sizeof(struct in6_addr), 1, env->capture);
+		break;
+	}
+	fwrite(buf, len, 1, env->capture);
+
+	if (ferror(env->capture)) {
+		log_warn("capture failed, stopping");
+		fclose(env->capture);
+		env->capture = NULL;
+	}
+}
+
+int
+replay_open(struct statsd *env, const char *path, int paced)
+{
+	struct capture_header	 ch;
+	struct stat		 sb;
+	void			*map;
+	int			 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("%s", path);
+		return (-1);
+	}
+	if (fstat(fd, &sb) == -1) {
+		log_warn("fstat");
+		close(fd);
+		return (-1);
+	}
+	if ((size_t)sb.st_size < sizeof(ch)) {
+		log_warnx("%s: not a capture", path);
+		close(fd);
+		return (-1);
+	}
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd,
+	    0)) == MAP_FAILED) {
+		log_warn("mmap");
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	memcpy(&ch, map, sizeof(ch));
+	if (memcmp(ch.magic, CAPTURE_MAGIC, sizeof(ch.magic)) ||
+	    ch.version != CAPTURE_VERSION) {
+		log_warnx("%s: not a capture", path);
+		munmap(map, sb.st_size);
+		return (-1);
+	}
+
+	replay.map = map;
+	replay.size = sb.st_size;
+	replay.off = sizeof(ch);
+	replay.paced = paced;
+	env->replay = 1;
+
+	return (0);
+}
+
+/* Replaying starts once graphite is connected, so the first intervals
+ * aren't lost, or after one reconnect interval if it never is
+ */
+void
+replay_start(struct statsd *env)
+{
+	if (!env->replay || replay.started)
+		return;
+
+	replay.started = 1;
+	if (replay.start_ev != NULL)
+		evtimer_del(replay.start_ev);
+
+	log_info("replaying %zu bytes of capture%s", replay.size,
+	    replay.paced ? " at the original pace" : "");
+
+	replay.real_start = hist_now();
+	replay.ev = evtimer_new(env->base, replay_cb, (void *)env);
+	event_active(replay.ev, EV_TIMEOUT, 0);
+}
+
+void
+replay_start_cb(int fd, short event, void *arg)
+{
+	replay_start((struct statsd *)arg);
+}
+
+void
+replay_schedule(struct statsd *env)
+{
+	replay.start_ev = evtimer_new(env->base, replay_start_cb, (void *)env);
+	evtimer_add(replay.start_ev, &env->graphite_reconnect);
+}
+
+/* Take a snapshot at the virtual interval boundary and flush all of it
+ * before carrying on, so every run sends the same thing
+ */
+void
+replay_tick(struct statsd *env, uint64_t usec)
+{
+	env->clock.tv_sec = usec / 1000000ULL;
+	env->clock.tv_usec = usec % 1000000ULL;
+
+	graphite_timer_cb(-1, EV_TIMEOUT, env);
+	if (env->flush != NULL)
+		graphite_flush(env, SIZE_MAX);
+	replay.intervals++;
+}
+
+void
+replay_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct capture_record	 cr;
+	struct sockaddr_storage	 ss;
+	struct timeval		 tv;
+	char			 buf[STATSD_MAX_UDP_PACKET + 1];
+	const char		*p;
+	uint64_t		 interval, due, now;
+	size_t			 alen;
+	int			 n;
+
+	interval = ((uint64_t)env->graphite_interval.tv_sec * 1000000ULL) +
+	    env->graphite_interval.tv_usec;
+
+	for (n = 0; n < REPLAY_BATCH; n++) {
+		if (replay.size - replay.off < sizeof(cr)) {
+			replay_finish(env);
+			return;
+		}
+		memcpy(&cr, replay.map + replay.off, sizeof(cr));
+		switch (cr.family) {
+		case AF_INET:
+			alen = sizeof(struct in_addr);
+			break;
+		case AF_INET6:
+			alen = sizeof(struct in6_addr);
+			break;
+		default:
+			alen = 0;
+			break;
+		}
+		if (replay.size - replay.off - sizeof(cr) < alen + cr.len ||
+		    cr.len > STATSD_MAX_UDP_PACKET) {
+			log_warnx("capture truncated");
+			replay_finish(env);
+			return;
+		}
+
+		if (replay.packets == 0) {
+			replay.first = cr.usec;
+			replay.next_tick = cr.usec + interval;
+		}
+
+		/* Hold back until the record is due */
+		if (replay.paced) {
+			due = replay.real_start +
+			    ((cr.usec - replay.first) * 1000ULL);
+			if ((now = hist_now()) < due) {
+				tv.tv_sec = (due - now) / 1000000000ULL;
+				tv.tv_usec = ((due - now) % 1000000000ULL) /
+				    1000ULL;
+				evtimer_add(replay.ev, &tv);
+				return;
+			}
+		}
+
+		/* Every interval that ended before this record is flushed
+		 * first, then the loop gets to send it
+		 */
+		if (cr.usec >= replay.next_tick) {
+			replay_tick(env, replay.next_tick);
+			while (replay.next_tick <= cr.usec)
+				replay.next_tick += interval;
+			break;
+		}
+
+		p = replay.map + replay.off + sizeof(cr);
+		bzero(&ss, sizeof(ss));
+		ss.ss_family = cr.family;
+		switch (cr.family) {
+		case AF_INET:
+			memcpy(&((struct sockaddr_in *)&ss)->sin_addr, p,
+			    alen);
+			break;
+		case AF_INET6:
+			memcpy(&((struct sockaddr_in6 *)&ss)->sin6_addr, p,
+			    alen);
+			break;
+		default:
+			break;
+		}
+		memcpy(buf, p + alen, cr.len);
+		buf[cr.len] = '\0';
+		replay.off += sizeof(cr) + alen + cr.len;
+
+		env->clock.tv_sec = cr.usec / 1000000ULL;
+		env->clock.tv_usec = cr.usec % 1000000ULL;
+		env->bytes_rx += cr.len;
+		env->packets_rx++;
+		replay.packets++;
+
+		statsd_ingest(env, NULL, &ss, buf);
+	}
+
+	event_active(replay.ev, EV_TIMEOUT, 0);
+}
+
+/* Flush the partial interval at the end and exit once graphite has been
+ * sent everything
+ */
+void
+replay_finish(struct statsd *env)
+{
+	uint64_t	 elapsed;
+	struct timeval	 tv;
+
+	if (replay.packets > 0)
+		replay_tick(env, replay.next_tick);
+
+	elapsed = hist_now() - replay.real_start;
+	log_info("replayed %llu packets, %llu intervals in %llu.%03llus, "
+	    "%.0f packets/s", replay.packets, replay.intervals,
+	    (unsigned long long)(elapsed / 1000000000ULL),
+	    (unsigned long long)((elapsed / 1000000ULL) % 1000),
+	    elapsed ? replay.packets / (elapsed / 1e9) : 0);
+
+	munmap(replay.map, replay.size);
+	replay.map = NULL;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	evtimer_assign(replay.ev, env->base, replay_drain_cb, (void *)env);
+	evtimer_add(replay.ev, &tv);
+}
+
+void
+replay_drain_cb(int fd, short event, void *arg)
+{
+	struct statsd	*env = (struct statsd *)arg;
+	struct timeval	 tv;
+
+	if ((env->state & STATSD_GRAPHITE_CONNECTED) &&
+	    env->graphite_conn->bev != NULL &&
+	    evbuffer_get_length(bufferevent_get_output(
+	    env->graphite_conn->bev)) > 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		evtimer_add(replay.ev, &tv);
+		return;
+	}
+
+	event_base_loopexit(env->base, NULL);
+}
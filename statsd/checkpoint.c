@@ -0,0 +1,560 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "statsd.h"
+
+/* The checkpoint is a header followed by one record per statistic. It is
+ * only ever read back on the same host so values are stored in native
+ * byte order, a long double is stored as-is.
+ *
+ *	header:	magic[8] version:u32 reserved:u32 count:u64
+ *	record:	type:u8 pad:u8 namelen:u16 n:u32 tv_sec:i64 tagslen:u16
+ *		pad:u16[3] name[namelen] tags[tagslen]
+ *		counter, gauge:	value:long double
+ *		timer:		count:u64 n * (value:long double count:i32)
+ *		set:		n * (len:u16 value[len])
+ *		histogram:	count:u64 sum:long double n * (bound:double)
+ *				(n + 1) * (count:u64)
+ *
+ * Version 1 records stop after tv_sec and have no tags
+ */
+#define	CHECKPOINT_MAGIC	"EVSTATSD"
+#define	CHECKPOINT_VERSION	2
+
+struct checkpoint_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 reserved;
+	uint64_t	 count;
+};
+
+struct checkpoint_record {
+	uint8_t		 type;
+	uint8_t		 pad;
+	uint16_t	 namelen;
+	uint32_t	 n;
+	int64_t		 tv_sec;
+	uint16_t	 tagslen;
+	uint16_t	 pad2[3];
+};
+
+int		 checkpoint_record(FILE *, struct statistic *);
+const char	*checkpoint_read(struct statsd *, const char *, const char *,
+		    unsigned long long *);
+int		 checkpoint_dropped(struct statsd *, const char *);
+int		 checkpoint_refused(struct statsd *, const char *);
+void		 checkpoint_done(struct statsd *, int);
+
+int
+checkpoint_record(FILE *fp, struct statistic *stat)
+{
+	struct checkpoint_record	 cr;
+	struct reading			*r;
+	struct unique			*u;
+	uint64_t			 count;
+	int32_t				 rcount;
+	uint16_t			 len;
+
+	bzero(&cr, sizeof(cr));
+	cr.type = stat->type;
+	cr.namelen = strlen(stat->metric);
+	cr.tv_sec = stat->tv.tv_sec;
+	if (stat->tags != NULL)
+		cr.tagslen = strlen(stat->tags->tags);
+
+	switch (stat->type) {
+	case STATSD_TIMER:
+		RB_FOREACH(r, readings, &stat->value.timer.readings)
+			cr.n++;
+		break;
+	case STATSD_SET:
+		RB_FOREACH(u, uniques, &stat->value.uniques)
+			cr.n++;
+		break;
+	case STATSD_HISTOGRAM:
+		cr.n = stat->value.histogram.nbounds;
+		break;
+	default:
+		break;
+	}
+
+	fwrite(&cr, sizeof(cr), 1, fp);
+	fwrite(stat->metric, cr.namelen, 1, fp);
+	if (stat->tags != NULL)
+		fwrite(stat->tags->tags, cr.tagslen, 1, fp);
+
+	switch (stat->type) {
+	case STATSD_COUNTER:
+		/* FALLTHROUGH */
+	case STATSD_GAUGE:
+		fwrite(&stat->value.count, sizeof(long double), 1, fp);
+		break;
+	case STATSD_TIMER:
+		count = stat->value.timer.count;
+		fwrite(&count, sizeof(count), 1, fp);
+		RB_FOREACH(r, readings, &stat->value.timer.readings) {
+			rcount = r->count;
+			fwrite(&r->value, sizeof(long double), 1, fp);
+			fwrite(&rcount, sizeof(rcount), 1, fp);
+		}
+		break;
+	case STATSD_SET:
+		RB_FOREACH(u, uniques, &stat->value.uniques) {
+			len = strlen(u->value);
+			fwrite(&len, sizeof(len), 1, fp);
+			fwrite(u->value, len, 1, fp);
+		}
+		break;
+	case STATSD_HISTOGRAM:
+		count = stat->value.histogram.count;
+		fwrite(&count, sizeof(count), 1, fp);
+		fwrite(&stat->value.histogram.sum, sizeof(long double), 1, fp);
+		fwrite(stat->value.histogram.bounds, sizeof(double), cr.n, fp);
+		fwrite(stat->value.histogram.counts, sizeof(uint64_t),
+		    cr.n + 1, fp);
+		break;
+	default:
+		break;
+	}
+
+	return (ferror(fp) ? -1 : 0);
+}
+
+/* Anything a drop rule has been added for since isn't loaded */
+int
+checkpoint_dropped(struct statsd *env, const char *metric)
+{
+	struct rule	*r;
+	char		 name[BUFSIZ];
+
+	return (env->rule_root != NULL &&
+	    (r = rule_find(env, env->rule_root, metric, name,
+	    sizeof(name))) != NULL && r->action == RULE_DROP);
+}
+
+/* A checkpoint can't restore more than the limits and max-memory would
+ * have let in to begin with. Samples for a full prefix may have gone to
+ * its overflow statistic, which is restored like any other
+ */
+int
+checkpoint_refused(struct statsd *env, const char *metric)
+{
+	struct limit	*l;
+
+	if (env->limit_root != NULL &&
+	    (l = limit_find(env, metric)) != NULL &&
+	    strcmp(metric, l->overflow) && l->count >= l->max) {
+		l->dropped++;
+		env->limit_dropped++;
+		return (1);
+	}
+	if (env->max_memory && statsd_memory(env) >= env->max_memory) {
+		env->memory_refused++;
+		return (1);
+	}
+
+	return (0);
+}
+
+/* Write every statistic to the stream */
+int
+checkpoint_dump(struct statsd *env, FILE *fp)
+{
+	struct checkpoint_header	 ch;
+	struct statistic		*stat;
+	int				 i;
+
+	bzero(&ch, sizeof(ch));
+	memcpy(ch.magic, CHECKPOINT_MAGIC, sizeof(ch.magic));
+	ch.version = CHECKPOINT_VERSION;
+	for (i = 0; i < STATSD_MAX_TYPE; i++)
+		ch.count += env->count[i];
+
+	if (fwrite(&ch, sizeof(ch), 1, fp) != 1)
+		return (-1);
+
+	/* Write each type in name order, which is the cheapest order to
+	 * insert them back in again
+	 */
+	for (i = 0; i < STATSD_MAX_TYPE; i++)
+		RB_FOREACH(stat, type_statistics, &env->types[i])
+			if (checkpoint_record(fp, stat) == -1)
+				return (-1);
+
+	return (fflush(fp));
+}
+
+/* Write to a temporary file and rename it over the old checkpoint so
+ * there's always a complete one on disk
+ */
+int
+checkpoint_write(struct statsd *env, const char *path)
+{
+	struct timeval	 t0, t1;
+	FILE		*fp;
+	char		*tmp;
+	int		 fd;
+
+	gettimeofday(&t0, NULL);
+
+	if (asprintf(&tmp, "%s.XXXXXXXXXX", path) == -1)
+		return (-1);
+	if ((fd = mkstemp(tmp)) == -1) {
+		log_warn("mkstemp %s", tmp);
+		free(tmp);
+		return (-1);
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		log_warn("fdopen");
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return (-1);
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	if (checkpoint_dump(env, fp) == -1 || fsync(fd) == -1) {
+		log_warn("checkpoint %s", tmp);
+		fclose(fp);
+		unlink(tmp);
+		free(tmp);
+		return (-1);
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) == -1) {
+		log_warn("rename %s", tmp);
+		unlink(tmp);
+		free(tmp);
+		return (-1);
+	}
+	free(tmp);
+
+	gettimeofday(&t1, NULL);
+	timersub(&t1, &t0, &env->checkpoint_tv);
+
+	return (0);
+}
+
+/* The periodic checkpoint is written by a child process from its own
+ * copy of the statistics, so packets carry on being read however long
+ * the dump and fsync(2) take. Only the one at shutdown is written here
+ */
+void
+checkpoint_timer_cb(int fd, short event, void *arg)
+{
+	struct statsd	*env = (struct statsd *)arg;
+	pid_t		 pid;
+
+	/* A slow disk shouldn't pile up writers */
+	if (env->checkpoint_pid != 0) {
+		log_warnx("checkpoint still being written, skipping");
+		return;
+	}
+
+	gettimeofday(&env->checkpoint_start, NULL);
+	switch (pid = fork()) {
+	case -1:
+		log_warn("fork");
+		break;
+	case 0:
+		log_forked();
+		_exit(checkpoint_write(env, env->checkpoint_path) == -1);
+		/* NOTREACHED */
+	default:
+		env->checkpoint_pid = pid;
+		break;
+	}
+}
+
+void
+checkpoint_done(struct statsd *env, int status)
+{
+	struct timeval	 tv;
+
+	env->checkpoint_pid = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		log_warnx("checkpoint process failed");
+		return;
+	}
+
+	gettimeofday(&tv, NULL);
+	timersub(&tv, &env->checkpoint_start, &env->checkpoint_tv);
+}
+
+/* Collect the child once it has finished */
+void
+checkpoint_reap(struct statsd *env)
+{
+	int	 status;
+
+	if (env->checkpoint_pid != 0 &&
+	    waitpid(env->checkpoint_pid, &status, WNOHANG) > 0)
+		checkpoint_done(env, status);
+}
+
+/* Let the child finish before anything else writes the checkpoint */
+void
+checkpoint_wait(struct statsd *env)
+{
+	int	 status;
+
+	if (env->checkpoint_pid != 0 &&
+	    waitpid(env->checkpoint_pid, &status, 0) > 0)
+		checkpoint_done(env, status);
+	env->checkpoint_pid = 0;
+}
+
+/* Parse the records between p and end, returning NULL on success or a
+ * description of what was wrong with the file. Nothing is allocated for a
+ * value until all of it has been read, so a truncated file can't leak
+ */
+const char *
+checkpoint_read(struct statsd *env, const char *p, const char *end,
+    unsigned long long *loaded)
+{
+	struct checkpoint_header	 ch;
+	struct checkpoint_record	 cr;
+	struct statistic		*stat;
+	struct statistic		 find;
+	struct reading			*r1;
+	struct unique			*u1;
+	char				 name[BUFSIZ], tags[BUFSIZ];
+	double				 bounds[STATSD_HISTOGRAM_MAX_BOUNDS];
+	uint64_t			 counts[STATSD_HISTOGRAM_MAX_BOUNDS+1];
+	long double			 value;
+	uint64_t			 i, count;
+	uint32_t			 j;
+	int32_t				 rcount;
+	uint16_t			 len;
+	int				 exists;
+
+#define	CHECKPOINT_GET(dst, size)			\
+	do {						\
+		if ((size_t)(end - p) < (size))		\
+			return ("truncated");		\
+		memcpy((dst), p, (size));		\
+		p += (size);				\
+	} while (0)
+
+	CHECKPOINT_GET(&ch, sizeof(ch));
+	if (memcmp(ch.magic, CHECKPOINT_MAGIC, sizeof(ch.magic)))
+		return ("bad magic");
+	if (ch.version != 1 && ch.version != CHECKPOINT_VERSION)
+		return ("unsupported version");
+
+	for (i = 0; i < ch.count; i++) {
+		bzero(&cr, sizeof(cr));
+		CHECKPOINT_GET(&cr, (ch.version == 1) ?
+		    offsetof(struct checkpoint_record, tagslen) : sizeof(cr));
+		if (cr.type >= STATSD_MAX_TYPE || cr.namelen == 0 ||
+		    cr.namelen >= sizeof(name) || cr.tagslen >= sizeof(tags) ||
+		    (cr.type == STATSD_HISTOGRAM &&
+		    cr.n > STATSD_HISTOGRAM_MAX_BOUNDS))
+			return ("bad record");
+		CHECKPOINT_GET(name, cr.namelen);
+		name[cr.namelen] = '\0';
+		CHECKPOINT_GET(tags, cr.tagslen);
+		tags[cr.tagslen] = '\0';
+
+		/* Anything already received takes precedence, the record
+		 * is still read but thrown away
+		 */
+		find.metric = name;
+		find.tags = (cr.tagslen > 0) ? tagset_find(env, tags) : NULL;
+		if ((cr.tagslen > 0 && find.tags == NULL) ||
+		    RB_FIND(statistics, &env->stats, &find) == NULL)
+			exists = 0;
+		else
+			exists = 1;
+		if (exists || (cr.tagslen > 0 && !tags_valid(tags,
+		    cr.tagslen)) || checkpoint_dropped(env, name) ||
+		    checkpoint_refused(env, name))
+			stat = NULL;
+		else if ((stat = statistic_new(env, name,
+		    (cr.tagslen > 0) ? tags : NULL, cr.type)) == NULL)
+			return ("out of memory");
+		else {
+			stat->tv.tv_sec = cr.tv_sec;
+			/* As in limit_overflow() */
+			if (stat->limit != NULL &&
+			    !strcmp(name, stat->limit->overflow)) {
+				stat->limit->count--;
+				stat->limit = NULL;
+			}
+			(*loaded)++;
+		}
+
+		switch (cr.type) {
+		case STATSD_COUNTER:
+			/* FALLTHROUGH */
+		case STATSD_GAUGE:
+			CHECKPOINT_GET(&value, sizeof(value));
+			if (stat != NULL)
+				stat->value.count = value;
+			break;
+		case STATSD_TIMER:
+			CHECKPOINT_GET(&count, sizeof(count));
+			if (stat != NULL)
+				stat->value.timer.count = count;
+			for (j = 0; j < cr.n; j++) {
+				CHECKPOINT_GET(&value, sizeof(value));
+				CHECKPOINT_GET(&rcount, sizeof(rcount));
+				if (stat == NULL)
+					continue;
+				if ((r1 = calloc(1,
+				    sizeof(struct reading))) == NULL)
+					return ("out of memory");
+				r1->value = value;
+				r1->count = rcount;
+				if (RB_INSERT(readings,
+				    &stat->value.timer.readings, r1) != NULL)
+					free(r1);
+				else
+					statistic_grow(env, stat, READING_SIZE);
+			}
+			break;
+		case STATSD_SET:
+			for (j = 0; j < cr.n; j++) {
+				CHECKPOINT_GET(&len, sizeof(len));
+				if ((size_t)(end - p) < len)
+					return ("truncated");
+				if (stat == NULL) {
+					p += len;
+					continue;
+				}
+				if ((u1 = calloc(1,
+				    sizeof(struct unique))) == NULL ||
+				    (u1->value = calloc(len + 1,
+				    sizeof(char))) == NULL) {
+					free(u1);
+					return ("out of memory");
+				}
+				CHECKPOINT_GET(u1->value, len);
+				if (RB_INSERT(uniques,
+				    &stat->value.uniques, u1) != NULL) {
+					free(u1->value);
+					free(u1);
+				} else
+					statistic_grow(env, stat,
+					    UNIQUE_SIZE(u1));
+			}
+			break;
+		case STATSD_HISTOGRAM:
+			/* The statistic keeps the boundaries it was saved
+			 * with rather than what is configured now
+			 */
+			CHECKPOINT_GET(&count, sizeof(count));
+			CHECKPOINT_GET(&value, sizeof(value));
+			CHECKPOINT_GET(bounds, cr.n * sizeof(double));
+			CHECKPOINT_GET(counts, (cr.n + 1) * sizeof(uint64_t));
+			for (j = 1; j < cr.n; j++)
+				if (!(bounds[j - 1] < bounds[j]))
+					return ("bad record");
+			if (stat == NULL)
+				break;
+			if (histogram_bounds(env, stat, bounds, cr.n) == -1)
+				return ("out of memory");
+			memcpy(stat->value.histogram.counts, counts,
+			    (cr.n + 1) * sizeof(uint64_t));
+			stat->value.histogram.count = count;
+			stat->value.histogram.sum = value;
+			break;
+		default:
+			break;
+		}
+	}
+
+#undef	CHECKPOINT_GET
+
+	return (NULL);
+}
+
+/* Map the checkpoint and load every statistic from it */
+int
+checkpoint_load_fd(struct statsd *env, int fd)
+{
+	struct stat		 sb;
+	struct timeval		 t0, t1;
+	void			*map;
+	const char		*errstr;
+	unsigned long long	 loaded = 0;
+
+	gettimeofday(&t0, NULL);
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("fstat");
+		return (-1);
+	}
+	if (sb.st_size == 0)
+		return (0);
+
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd,
+	    0)) == MAP_FAILED) {
+		log_warn("mmap");
+		return (-1);
+	}
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+	errstr = checkpoint_read(env, map, (char *)map + sb.st_size,
+	    &loaded);
+	munmap(map, sb.st_size);
+
+	if (errstr) {
+		log_warnx("checkpoint: %s", errstr);
+		return (-1);
+	}
+
+	gettimeofday(&t1, NULL);
+	timersub(&t1, &t0, &t1);
+
+	log_info("loaded %llu statistics from checkpoint in %lld.%06lds",
+	    loaded, (long long)t1.tv_sec,
+	    (long)t1.tv_usec);
+
+	return (0);
+}
+
+int
+checkpoint_load(struct statsd *env, const char *path)
+{
+	int	 fd, rv;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			log_warn("%s", path);
+		return (-1);
+	}
+	rv = checkpoint_load_fd(env, fd);
+	close(fd);
+
+	return (rv);
+}
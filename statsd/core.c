@@ -0,0 +1,937 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Parsing and aggregation, everything between a packet arriving and a
+ * snapshot being taken of the statistics. Nothing in here touches a
+ * socket so it can be driven from a buffer by the benchmarks and fuzzer
+ * as well as the daemon
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+RB_GENERATE(statistics, statistic, entry, statistic_cmp);
+
+RB_GENERATE(type_statistics, statistic, type_entry, statistic_cmp);
+
+RB_GENERATE(readings, reading, entry, reading_cmp);
+
+RB_GENERATE(uniques, unique, entry, unique_cmp);
+
+const char	*bad_names[BAD_MAX] = {
+	"no_metric",
+	"no_colon",
+	"bad_value",
+	"no_pipe",
+	"bad_type",
+	"no_at",
+	"bad_rate",
+	"bad_tags",
+	"type_conflict"
+};
+
+int
+statistic_cmp(struct statistic *s1, struct statistic *s2)
+{
+	unsigned int	 t1, t2;
+	int		 rv;
+
+	if ((rv = strcmp(s1->metric, s2->metric)) != 0)
+		return (rv);
+
+	t1 = (s1->tags != NULL) ? s1->tags->id : 0;
+	t2 = (s2->tags != NULL) ? s2->tags->id : 0;
+
+	return ((t1 > t2) - (t1 < t2));
+}
+
+int
+reading_cmp(struct reading *r1, struct reading *r2)
+{
+	if (r1->value > r2->value)
+		return (1);
+	else if (r1->value < r2->value)
+		return (-1);
+	else
+		return (0);
+}
+
+int
+unique_cmp(struct unique *u1, struct unique *u2)
+{
+	return (strcmp(u1->value, u2->value));
+}
+
+/* Set up the lists and trees of a zeroed environment, shared by the
+ * configuration parser, the benchmarks and the fuzzer
+ */
+void
+statsd_env_init(struct statsd *env)
+{
+	int	 i;
+
+	TAILQ_INIT(&env->listen_addrs);
+	TAILQ_INIT(&env->histograms);
+	TAILQ_INIT(&env->rules);
+	TAILQ_INIT(&env->aggregates);
+	TAILQ_INIT(&env->limits);
+	TAILQ_INIT(&env->rollups);
+	RB_INIT(&env->stats);
+	for (i = 0; i < STATSD_MAX_TYPE; i++)
+		RB_INIT(&env->types[i]);
+}
+
+/* The tags, if any, must already be canonical */
+struct statistic *
+statistic_new(struct statsd *env, const char *metric, const char *tags,
+    enum statistic_type type)
+{
+	struct statistic	*stat;
+	const double		*bounds;
+	size_t			 n;
+
+	if ((stat = calloc(1, sizeof(struct statistic))) == NULL)
+		return (NULL);
+	if ((stat->metric = strdup(metric)) == NULL) {
+		free(stat);
+		return (NULL);
+	}
+	if (tags != NULL && (stat->tags = tagset_get(env, tags)) == NULL) {
+		free(stat->metric);
+		free(stat);
+		return (NULL);
+	}
+	stat->type = type;
+	TAILQ_INIT(&stat->members);
+
+	switch (type) {
+	case STATSD_TIMER:
+		RB_INIT(&stat->value.timer.readings);
+		break;
+	case STATSD_SET:
+		RB_INIT(&stat->value.uniques);
+		break;
+	case STATSD_HISTOGRAM:
+		bounds = histogram_find(env, metric, &n);
+		if (histogram_bounds(env, stat, bounds, n) == -1) {
+			if (stat->tags != NULL)
+				tagset_put(env, stat->tags);
+			free(stat->metric);
+			free(stat);
+			return (NULL);
+		}
+		break;
+	default:
+		break;
+	}
+
+	RB_INSERT(statistics, &env->stats, stat);
+	RB_INSERT(type_statistics, &env->types[type], stat);
+
+	env->count[type]++;
+	env->memory += STATISTIC_SIZE(stat);
+
+	if ((stat->limit = limit_find(env, metric)) != NULL)
+		stat->limit->count++;
+
+	return (stat);
+}
+
+void
+statistic_delete(struct statsd *env, struct statistic *stat)
+{
+	struct reading		*r1, *r2;
+	struct unique		*u1, *u2;
+
+	env->count[stat->type]--;
+	env->memory -= STATISTIC_SIZE(stat) + stat->size;
+	if (stat->limit != NULL)
+		stat->limit->count--;
+
+	RB_REMOVE(statistics, &env->stats, stat);
+	RB_REMOVE(type_statistics, &env->types[stat->type], stat);
+	aggregate_leave(env, stat);
+
+	/* Some statistic types require additional cleanup */
+	switch (stat->type) {
+	case STATSD_TIMER:
+		r1 = RB_MIN(readings, &stat->value.timer.readings);
+		while (r1 != NULL) {
+			r2 = RB_NEXT(readings, &stat->value.timer.readings, r1);
+			RB_REMOVE(readings, &stat->value.timer.readings, r1);
+			free(r1);
+			r1 = r2;
+		}
+		break;
+	case STATSD_SET:
+		u1 = RB_MIN(uniques, &stat->value.uniques);
+		while (u1 != NULL) {
+			u2 = RB_NEXT(uniques, &stat->value.uniques, u1);
+			RB_REMOVE(uniques, &stat->value.uniques, u1);
+			free(u1->value);
+			free(u1);
+			u1 = u2;
+		}
+		break;
+	case STATSD_HISTOGRAM:
+		free(stat->value.histogram.bounds);
+		break;
+	default:
+		break;
+	}
+
+	if (stat->tags != NULL)
+		tagset_put(env, stat->tags);
+	free(stat->metric);
+	free(stat);
+}
+
+/* Account for readings or uniques added to a statistic */
+void
+statistic_grow(struct statsd *env, struct statistic *stat, size_t size)
+{
+	stat->size += size;
+	env->memory += size;
+}
+
+/* Account for readings or uniques taken away from a statistic */
+void
+statistic_shrink(struct statsd *env, struct statistic *stat, size_t size)
+{
+	stat->size -= size;
+	env->memory -= size;
+}
+
+/* Everything held by the statistics, whichever snapshots are still
+ * being flushed or served and the rollups being built up
+ */
+size_t
+statsd_memory(struct statsd *env)
+{
+	size_t	 memory = env->memory;
+
+	/* Only this thread changes which snapshot is published */
+	if (env->published != NULL)
+		memory += env->published->size;
+	if (env->flush != NULL && env->flush != env->published)
+		memory += env->flush->size;
+	memory += env->rollup_memory;
+
+	return (memory);
+}
+
+/* The first statistic of a type whose name is not less than the given
+ * one. The name is only compared, never stored in a statistic, so it can
+ * stay const unlike with RB_NFIND()
+ */
+struct statistic *
+statistic_nfind(struct statsd *env, enum statistic_type type,
+    const char *metric)
+{
+	struct statistic	*stat = RB_ROOT(&env->types[type]);
+	struct statistic	*found = NULL;
+
+	while (stat != NULL)
+		if (strcmp(stat->metric, metric) >= 0) {
+			found = stat;
+			stat = RB_LEFT(stat, type_entry);
+		} else
+			stat = RB_RIGHT(stat, type_entry);
+
+	return (found);
+}
+
+/* Names are sorted so everything under a prefix is one contiguous range
+ * of the type index, starting from the first name not less than it
+ */
+unsigned long long
+statistic_delete_prefix(struct statsd *env, enum statistic_type type,
+    const char *prefix)
+{
+	struct statistic	*stat, *next;
+	unsigned long long	 count = 0;
+	size_t			 len;
+
+	len = strlen(prefix);
+	for (stat = statistic_nfind(env, type, prefix);
+	    stat && !strncmp(stat->metric, prefix, len); stat = next) {
+		next = RB_NEXT(type_statistics, &env->types[type], stat);
+		statistic_delete(env, stat);
+		count++;
+	}
+
+	return (count);
+}
+
+/* Find the value at quantile q, the readings are sorted and each carries a
+ * count of how many times it was seen
+ */
+long double
+readings_quantile(struct readings *head, unsigned long long count, double q)
+{
+	struct reading		*r;
+	unsigned long long	 rank, seen = 0;
+
+	if (RB_EMPTY(head))
+		return (0);
+
+	/* Nearest rank, i.e. ceil(q * count) counting from zero */
+	rank = (unsigned long long)(q * count);
+	if ((long double)rank < q * count)
+		rank++;
+	if (rank > 0)
+		rank--;
+	if (rank >= count)
+		rank = count - 1;
+
+	RB_FOREACH(r, readings, head) {
+		seen += r->count;
+		if (seen > rank)
+			return (r->value);
+	}
+
+	return (RB_MAX(readings, head)->value);
+}
+
+struct snapshot *
+snapshot_new(struct statsd *env)
+{
+	struct snapshot		*snap;
+	struct statistic	*stat;
+	struct listen_addr	*la;
+	struct snapshot_listener	*sl;
+	size_t			 count, n = 0;
+	int			 i;
+
+	for (i = 0, count = 0; i < STATSD_MAX_TYPE; i++)
+		count += env->count[i];
+
+	if ((snap = calloc(1, sizeof(struct snapshot))) == NULL)
+		return (NULL);
+	if (count > 0 &&
+	    (snap->stats = calloc(count, sizeof(struct snapshot_stat))) == NULL) {
+		free(snap);
+		return (NULL);
+	}
+
+	snap->refcnt = 1;
+	snap->size = sizeof(struct snapshot) +
+	    count * sizeof(struct snapshot_stat);
+	statsd_time(env, &snap->tv);
+
+	/* Copy or move each value and reset the statistic ready for the
+	 * next interval, the expensive part of the flush is done later.
+	 * Walking each type in turn leaves the snapshot grouped by type
+	 */
+	for (i = 0; i < STATSD_MAX_TYPE; i++) {
+		snap->first[i] = snap->count;
+		RB_FOREACH(stat, type_statistics, &env->types[i]) {
+			if (snap->count == count)
+				break;
+			/* Only the aggregate is sent for suppressed
+			 * members, which it has already emptied
+			 */
+			if (stat->aggregate != NULL &&
+			    stat->aggregate->rule->suppress)
+				continue;
+			snapshot_stat(&snap->stats[snap->count++], stat);
+			snap->size += strlen(stat->metric) + 1 + stat->size;
+			if (stat->tags != NULL)
+				snap->size += strlen(stat->tags->tags) + 1;
+			/* Histograms keep their buckets, the snapshot
+			 * has a copy
+			 */
+			if (stat->type == STATSD_HISTOGRAM)
+				continue;
+			env->memory -= stat->size;
+			stat->size = 0;
+		}
+	}
+	snap->first[STATSD_MAX_TYPE] = snap->count;
+
+	for (i = 0; i < TOP_MAX; i++) {
+		snap->top[i] = top_copy(&env->top[i], &snap->ntop[i]);
+		top_reset(&env->top[i]);
+	}
+
+	/* Rejected lines are counted from startup rather than per interval */
+	memcpy(snap->bad, env->bad, sizeof(snap->bad));
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		n++;
+	if (n > 0 && (snap->listeners = calloc(n,
+	    sizeof(struct snapshot_listener))) != NULL) {
+		snap->size += n * sizeof(struct snapshot_listener);
+		TAILQ_FOREACH(la, &env->listen_addrs, entry) {
+			sl = &snap->listeners[snap->nlisteners];
+			if (asprintf(&sl->name, "%s:%d",
+			    log_sockaddr((struct sockaddr *)&la->sa),
+			    la->port) == -1)
+				break;
+			memcpy(sl->bad, la->bad, sizeof(sl->bad));
+			snap->nlisteners++;
+		}
+	}
+
+	return (snap);
+}
+
+void
+snapshot_stat(struct snapshot_stat *ss, struct statistic *stat)
+{
+	size_t	 n;
+
+	if ((ss->metric = strdup(stat->metric)) == NULL ||
+	    (stat->tags != NULL &&
+	    (ss->tags = strdup(stat->tags->tags)) == NULL))
+		fatal("strdup");
+	ss->tv = stat->tv;
+	ss->type = stat->type;
+	switch (stat->type) {
+	case STATSD_COUNTER:
+		ss->value.count = stat->value.count;
+		stat->value.count = 0;
+		break;
+	case STATSD_GAUGE:
+		ss->value.count = stat->value.count;
+		break;
+	case STATSD_TIMER:
+		ss->value.timer.readings = stat->value.timer.readings;
+		ss->value.timer.count = stat->value.timer.count;
+		RB_INIT(&stat->value.timer.readings);
+		stat->value.timer.count = 0;
+		break;
+	case STATSD_SET:
+		ss->value.set.uniques = stat->value.uniques;
+		RB_INIT(&stat->value.uniques);
+		break;
+	case STATSD_HISTOGRAM:
+		/* The counts are a fixed size so copy and zero them */
+		n = stat->value.histogram.nbounds;
+		if ((ss->value.histogram.bounds = malloc(
+		    HISTOGRAM_SIZE(n))) == NULL)
+			fatal("malloc");
+		memcpy(ss->value.histogram.bounds,
+		    stat->value.histogram.bounds, HISTOGRAM_SIZE(n));
+		ss->value.histogram.counts =
+		    (unsigned long long *)(ss->value.histogram.bounds + n);
+		ss->value.histogram.nbounds = n;
+		ss->value.histogram.count = stat->value.histogram.count;
+		ss->value.histogram.sum = stat->value.histogram.sum;
+		bzero(stat->value.histogram.counts,
+		    (n + 1) * sizeof(unsigned long long));
+		stat->value.histogram.count = 0;
+		stat->value.histogram.sum = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+struct snapshot *
+snapshot_ref(struct snapshot *snap)
+{
+	__sync_add_and_fetch(&snap->refcnt, 1);
+	return (snap);
+}
+
+void
+snapshot_stat_free(struct snapshot_stat *ss)
+{
+	struct reading		*r1, *r2;
+	struct unique		*u1, *u2;
+
+	switch (ss->type) {
+	case STATSD_TIMER:
+		for (r1 = RB_MIN(readings, &ss->value.timer.readings);
+		    r1 != NULL; r1 = r2) {
+			r2 = RB_NEXT(readings, &ss->value.timer.readings, r1);
+			RB_REMOVE(readings, &ss->value.timer.readings, r1);
+			free(r1);
+		}
+		break;
+	case STATSD_SET:
+		for (u1 = RB_MIN(uniques, &ss->value.set.uniques);
+		    u1 != NULL; u1 = u2) {
+			u2 = RB_NEXT(uniques, &ss->value.set.uniques, u1);
+			RB_REMOVE(uniques, &ss->value.set.uniques, u1);
+			free(u1->value);
+			free(u1);
+		}
+		break;
+	case STATSD_HISTOGRAM:
+		free(ss->value.histogram.bounds);
+		break;
+	default:
+		break;
+	}
+	free(ss->metric);
+	free(ss->tags);
+}
+
+void
+snapshot_unref(struct snapshot *snap)
+{
+	size_t			 i, j;
+
+	if (__sync_sub_and_fetch(&snap->refcnt, 1) > 0)
+		return;
+
+	for (i = 0; i < snap->count; i++)
+		snapshot_stat_free(&snap->stats[i]);
+	for (i = 0; i < TOP_MAX; i++) {
+		for (j = 0; j < snap->ntop[i]; j++)
+			free(snap->top[i][j].key);
+		free(snap->top[i]);
+	}
+	for (i = 0; i < snap->nlisteners; i++)
+		free(snap->listeners[i].name);
+	free(snap->listeners);
+	free(snap->stats);
+	free(snap->prefix);
+	free(snap);
+}
+
+/* Work out the figures sent for a statistic, they are kept in the
+ * snapshot for anything else that wants them later
+ */
+void
+snapshot_summarise(struct snapshot_stat *ss)
+{
+	struct reading		*r;
+	struct unique		*u;
+
+	switch (ss->type) {
+	case STATSD_TIMER:
+		if (RB_EMPTY(&ss->value.timer.readings))
+			break;
+		ss->value.timer.lower = RB_MIN(readings,
+		    &ss->value.timer.readings)->value;
+		ss->value.timer.upper = RB_MAX(readings,
+		    &ss->value.timer.readings)->value;
+		RB_FOREACH(r, readings, &ss->value.timer.readings)
+			ss->value.timer.sum += r->value * r->count;
+		ss->value.timer.mean = ss->value.timer.sum /
+		    ss->value.timer.count;
+		break;
+	case STATSD_SET:
+		RB_FOREACH(u, uniques, &ss->value.set.uniques)
+			ss->value.set.count++;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Count a rejected line against its reason and the socket it arrived on,
+ * and remember who sent it
+ */
+void
+statsd_bad(struct statsd *env, struct listen_addr *la,
+    struct sockaddr_storage *ss, enum bad_reason reason)
+{
+	env->bad[reason]++;
+	if (la != NULL)
+		la->bad[reason]++;
+	if (ss != NULL)
+		top_update_addr(&env->top[TOP_BAD], ss, 1);
+}
+
+/* Parse one "value|type[|@rate]" group starting at p, without modifying
+ * it. Returns where the group ends, at the ':' before another group or
+ * the end of the line, or NULL if it is bad
+ */
+char *
+sample_value(char *p, struct sample *s, enum bad_reason *reason)
+{
+	char	*end, *type, *field, *next;
+	size_t	 len;
+
+	/* Thanks to the set type, the original string value is kept to
+	 * track for uniqueness as well as the parsed double
+	 */
+	s->value = p;
+	if (((s->number = strtod(s->value, &end)) == 0) && end == s->value) {
+		*reason = BAD_VALUE;
+		return (NULL);
+	}
+	if (*end != '|') {
+		*reason = BAD_PIPE;
+		return (NULL);
+	}
+
+	/* Counter, timer, gauge, set or histogram? */
+	type = end + 1;
+	len = strcspn(type, "|:");
+	if (len == 1 && *type == 'c')
+		s->type = STATSD_COUNTER;
+	else if (len == 2 && !strncmp(type, "ms", len))
+		s->type = STATSD_TIMER;
+	else if (len == 1 && *type == 'g')
+		s->type = STATSD_GAUGE;
+	else if (len == 1 && *type == 's')
+		s->type = STATSD_SET;
+	else if (len == 1 && *type == 'h')
+		s->type = STATSD_HISTOGRAM;
+	else {
+		*reason = BAD_TYPE;
+		return (NULL);
+	}
+
+	/* Then a sample rate, which only counters and timers support.
+	 * Tags have already been dealt with and anything else is ignored
+	 * on gauges, sets and histograms
+	 */
+	s->rate = 1;
+	for (field = type + len; *field == '|'; field = next) {
+		field++;
+		if (*field == '#') {
+			next = field + strcspn(field, "|");
+			continue;
+		}
+		next = field + strcspn(field, "|:");
+		if (s->type != STATSD_COUNTER && s->type != STATSD_TIMER)
+			continue;
+		if (*field != '@') {
+			*reason = BAD_AT;
+			return (NULL);
+		}
+		if ((s->rate = strtod(field + 1, &end)) <= 0 ||
+		    end == field + 1 || end != next) {
+			*reason = BAD_RATE;
+			return (NULL);
+		}
+	}
+
+	return (field);
+}
+
+/* Split one line, already terminated, into its name, tags and first
+ * value. Like Etsy statsd a line may carry several values for the same
+ * name, "name:1|c:2|c:340|ms", which sample_next() steps through. Tags
+ * are only sent once, at the end, and belong to every value. The line is
+ * only modified once it is known to be good so a rejected one can be
+ * logged as it arrived
+ */
+int
+sample_parse(char *line, struct sample *s, enum bad_reason *reason)
+{
+	char	*colon, *end, *tags;
+
+	if ((colon = strchr(line, ':')) == NULL) {
+		*reason = BAD_COLON;
+		return (-1);
+	}
+	if (colon == line) {
+		*reason = BAD_METRIC;
+		return (-1);
+	}
+
+	if ((tags = strstr(colon, "|#")) != NULL) {
+		tags += 2;
+		if (!tags_valid(tags, strcspn(tags, "|"))) {
+			*reason = BAD_TAGS;
+			return (-1);
+		}
+	}
+
+	if ((end = sample_value(colon + 1, s, reason)) == NULL)
+		return (-1);
+
+	if (tags != NULL)
+		tags[strcspn(tags, "|")] = '\0';
+	s->tags = tags;
+	*colon = '\0';
+	s->metric = line;
+	s->next = (*end == ':') ? end + 1 : NULL;
+	s->stat = NULL;
+	s->value[strcspn(s->value, "|")] = '\0';
+	s->relative = (*s->value == '+' || *s->value == '-');
+
+	return (0);
+}
+
+/* Move on to the next value on the line. Returns 1 once there are no
+ * more, and -1 if the next one is bad, the rest of the line is ignored
+ */
+int
+sample_next(struct sample *s, enum bad_reason *reason)
+{
+	char	*end;
+
+	if (s->next == NULL)
+		return (1);
+	if ((end = sample_value(s->next, s, reason)) == NULL) {
+		s->next = NULL;
+		return (-1);
+	}
+
+	s->next = (*end == ':') ? end + 1 : NULL;
+	s->value[strcspn(s->value, "|")] = '\0';
+	s->relative = (*s->value == '+' || *s->value == '-');
+
+	return (0);
+}
+
+/* Fold a sample into its statistic, creating the statistic if need be.
+ * Returns -1 if the metric already exists as a different type
+ */
+int
+sample_update(struct statsd *env, struct sample *s)
+{
+	struct statistic	 find;
+	struct statistic	*stat;
+	struct reading		 rfind;
+	struct reading		*r;
+	struct unique		 ufind;
+	struct unique		*u;
+	struct limit		*l;
+	struct rule		*rule = NULL;
+	char			 tags[STATSD_MAX_UDP_PACKET];
+	char			 name[STATSD_MAX_UDP_PACKET];
+	char			*metric = s->metric;
+	uint64_t		 t0, t1;
+	size_t			 i;
+
+	/* Later values on a line go to the statistic found for the first,
+	 * so only it pays for canonicalising the tags and the lookup
+	 */
+	if ((stat = s->stat) != NULL)
+		goto found;
+
+	t0 = hist_now();
+
+	find.metric = s->metric;
+	find.tags = NULL;
+	if (s->tags != NULL) {
+		if (tags_canonical(s->tags, tags, sizeof(tags)) == -1)
+			return (0);
+		find.tags = tagset_find(env, tags);
+	}
+
+	/* A statistic can't carry a set of tags that has never been seen */
+	if (s->tags != NULL && find.tags == NULL)
+		stat = NULL;
+	else
+		stat = RB_FIND(statistics, &env->stats, &find);
+
+	/* Only a name that isn't already a statistic is matched against
+	 * the rules, a rewritten one is then looked for under its new name
+	 */
+	if (!stat && env->rule_root != NULL &&
+	    (rule = rule_lookup(env, s->metric, name,
+	    sizeof(name))) != NULL && rule->action == RULE_REWRITE) {
+		metric = find.metric = name;
+		if (s->tags == NULL || find.tags != NULL)
+			stat = RB_FIND(statistics, &env->stats, &find);
+	}
+
+	/* Track how much time we spend searching for metrics */
+	t1 = hist_now() - t0;
+	env->seek_ns += t1;
+	hist_add(&env->hist[HIST_LOOKUP], t1);
+
+found:
+	/* Same metric name, different type */
+	if (stat && stat->type != s->type)
+		return (-1);
+
+	env->metrics_rx++;
+	top_update(&env->top[TOP_METRICS], s->metric, strlen(s->metric), 1);
+
+	if (rule != NULL) {
+		if (rule->action == RULE_DROP) {
+			env->rule_dropped++;
+			return (0);
+		}
+		env->rule_rewritten++;
+	}
+
+	/* A full prefix either drops new metrics or folds them into
+	 * its overflow statistic
+	 */
+	if (!stat && env->limit_root != NULL &&
+	    (l = limit_find(env, metric)) != NULL && l->count >= l->max) {
+		if (l->action == LIMIT_DROP ||
+		    (stat = limit_overflow(env, l, s->type)) == NULL) {
+			l->dropped++;
+			env->limit_dropped++;
+			return (0);
+		}
+		env->limit_overflowed++;
+	}
+
+	/* Existing statistics carry on regardless but no new ones are
+	 * created past the memory limit
+	 */
+	if (!stat && env->max_memory &&
+	    statsd_memory(env) >= env->max_memory) {
+		env->memory_refused++;
+		return (0);
+	}
+
+	if (!stat) {
+		if ((stat = statistic_new(env, metric,
+		    (s->tags != NULL) ? tags : NULL, s->type)) == NULL) {
+			log_warn("statistic_new");
+			return (0);
+		}
+		aggregate_join(env, stat);
+	}
+	if (s->next != NULL)
+		s->stat = stat;
+
+	switch (stat->type) {
+	case STATSD_COUNTER:
+		stat->value.count += s->number * (1 / s->rate);
+		break;
+	case STATSD_GAUGE:
+		if (s->relative)
+			stat->value.count += s->number;
+		else
+			stat->value.count = s->number;
+		break;
+	case STATSD_TIMER:
+		/* Blame pesky median averages for this */
+		rfind.value = s->number;
+		if ((r = RB_FIND(readings, &stat->value.timer.readings,
+		    &rfind)) != NULL)
+			r->count++;
+		else {
+			if ((r = calloc(1, sizeof(struct reading))) == NULL) {
+				log_warn("calloc");
+				break;
+			}
+			r->value = s->number;
+			r->count = 1;
+			RB_INSERT(readings, &stat->value.timer.readings, r);
+			statistic_grow(env, stat, READING_SIZE);
+		}
+		stat->value.timer.count++;
+		break;
+	case STATSD_SET:
+		/* Only copy the value if it hasn't been seen */
+		ufind.value = s->value;
+		if (RB_FIND(uniques, &stat->value.uniques, &ufind) != NULL) {
+			if (env->verbose)
+				log_debug("\"%s\" already in set", s->value);
+			break;
+		}
+		if ((u = calloc(1, sizeof(struct unique))) == NULL ||
+		    (u->value = strdup(s->value)) == NULL) {
+			log_warn("calloc");
+			free(u);
+			break;
+		}
+		RB_INSERT(uniques, &stat->value.uniques, u);
+		statistic_grow(env, stat, UNIQUE_SIZE(u));
+		break;
+	case STATSD_HISTOGRAM:
+		i = histogram_bucket(stat->value.histogram.bounds,
+		    stat->value.histogram.nbounds, s->number);
+		stat->value.histogram.counts[i]++;
+		stat->value.histogram.count++;
+		stat->value.histogram.sum += s->number;
+		break;
+	default:
+		break;
+	}
+
+	/* Record last time this metric was updated */
+	statsd_time(env, &stat->tv);
+
+	return (0);
+}
+
+/* Parse and apply every line in a packet. The buffer must be terminated
+ * and is modified in place, the listener and sender are optional and
+ * only used to account for bad lines
+ */
+void
+statsd_ingest(struct statsd *env, struct listen_addr *la,
+    struct sockaddr_storage *ss, char *buf)
+{
+	struct sample		 s;
+	enum bad_reason		 reason;
+	char			*line, *next;
+	unsigned long long	 samples = 0;
+	uint64_t		 start;
+	int			 rv;
+
+	start = hist_now();
+
+	for (line = buf; *line != '\0'; line = next) {
+		next = line + strcspn(line, "\n");
+		if (*next == '\n')
+			*next++ = '\0';
+		if (*line == '\0')
+			continue;
+		samples++;
+
+		if (sample_parse(line, &s, &reason) == -1) {
+			log_warnx_limit(&env->log_limit, "Bad line \"%s\": %s",
+			    line, bad_names[reason]);
+			statsd_bad(env, la, ss, reason);
+			continue;
+		}
+
+		do {
+			if (sample_update(env, &s) == -1) {
+				log_warnx_limit(&env->log_limit,
+				    "Metric %s already exists with different "
+				    "type", s.metric);
+				statsd_bad(env, la, ss, BAD_CONFLICT);
+			}
+			if (s.next == NULL)
+				break;
+			samples++;
+
+			/* Only the bad value and what follows is left */
+			line = s.next;
+			if ((rv = sample_next(&s, &reason)) == -1) {
+				log_warnx_limit(&env->log_limit,
+				    "Bad value \"%s\" for %s: %s", line,
+				    s.metric, bad_names[reason]);
+				statsd_bad(env, la, ss, reason);
+			}
+		} while (rv == 0);
+	}
+
+	hist_add(&env->hist[HIST_PARSE], hist_now() - start);
+
+	/* Weight each sender by how much work it made */
+	if (ss != NULL)
+		top_update_addr(&env->top[TOP_SOURCES], ss, samples);
+}
+
+/* The time as far as the statistics are concerned, which when replaying
+ * a capture is the time the packet being replayed was received
+ */
+void
+statsd_time(struct statsd *env, struct timeval *tv)
+{
+	if (env->replay)
+		*tv = env->clock;
+	else
+		gettimeofday(tv, NULL);
+}
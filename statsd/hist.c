@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "statsd.h"
+
+/* Log-linear histograms: values below 2^HIST_SUB_BITS get a bucket each,
+ * above that every power of two is split into 2^HIST_SUB_BITS equal
+ * buckets. Adding a value is a count-leading-zeros and an increment, and
+ * any quantile is within 1/2^HIST_SUB_BITS of the true value
+ */
+#define	HIST_SUB	(1 << HIST_SUB_BITS)
+
+const char	*hist_names[HIST_MAX] = {
+	"parse.ns",
+	"lookup.ns",
+	"flush.walk.ns",
+	"flush.serialize.ns",
+	"graphite.backlog.bytes"
+};
+
+unsigned int	 hist_bucket(uint64_t);
+uint64_t	 hist_value(unsigned int);
+
+unsigned int
+hist_bucket(uint64_t v)
+{
+	unsigned int	 e;
+
+	if (v < HIST_SUB)
+		return (v);
+
+	e = 63 - __builtin_clzll(v);
+	return (((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	    ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+/* Largest value that lands in the bucket */
+uint64_t
+hist_value(unsigned int b)
+{
+	unsigned int	 e;
+
+	if (b < HIST_SUB)
+		return (b);
+
+	e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return ((((uint64_t)(HIST_SUB + (b & (HIST_SUB - 1))) + 1) <<
+	    (e - HIST_SUB_BITS)) - 1);
+}
+
+uint64_t
+hist_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec);
+}
+
+void
+hist_add(struct hist *h, uint64_t v)
+{
+	unsigned int	 b;
+
+	if ((b = hist_bucket(v)) >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+	h->buckets[b]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint64_t
+hist_quantile(struct hist *h, double q)
+{
+	unsigned long long	 rank, seen = 0;
+	unsigned int		 b;
+
+	if (h->count == 0)
+		return (0);
+
+	/* Nearest rank, as with timers */
+	rank = (unsigned long long)(q * h->count);
+	if (rank < q * h->count)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if ((seen += h->buckets[b]) >= rank)
+			return (MIN(hist_value(b), h->max));
+
+	return (h->max);
+}
+
+void
+hist_reset(struct hist *h)
+{
+	bzero(h, sizeof(*h));
+}
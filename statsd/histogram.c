@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* Histogram statistics count samples into fixed buckets rather than
+ * keeping them, so one costs the same however many samples it sees. The
+ * bucket boundaries come from the first "histogram" rule whose pattern
+ * matches the name, and are copied into the statistic when it is created
+ * so a reload only affects new ones
+ */
+const double	 histogram_defaults[] = {
+	1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+void
+histogram_free(struct statsd *env)
+{
+	struct histogram	*h;
+
+	while ((h = TAILQ_FIRST(&env->histograms)) != NULL) {
+		TAILQ_REMOVE(&env->histograms, h, entry);
+		free(h->pattern);
+		free(h->bounds);
+		free(h);
+	}
+}
+
+/* Bucket boundaries for a new histogram statistic */
+const double *
+histogram_find(struct statsd *env, const char *metric, size_t *n)
+{
+	struct histogram	*h;
+
+	TAILQ_FOREACH(h, &env->histograms, entry)
+		if (fnmatch(h->pattern, metric, 0) == 0) {
+			*n = h->nbounds;
+			return (h->bounds);
+		}
+
+	*n = sizeof(histogram_defaults) / sizeof(histogram_defaults[0]);
+	return (histogram_defaults);
+}
+
+/* Give a histogram statistic its own copy of the boundaries with every
+ * bucket emptied. The boundaries and counts share one allocation, with a
+ * count for each boundary and one more for anything above the last
+ */
+int
+histogram_bounds(struct statsd *env, struct statistic *stat,
+    const double *bounds, size_t n)
+{
+	double	*b;
+
+	if ((b = calloc(1, HISTOGRAM_SIZE(n))) == NULL)
+		return (-1);
+	memcpy(b, bounds, n * sizeof(double));
+
+	if (stat->value.histogram.bounds != NULL) {
+		free(stat->value.histogram.bounds);
+		statistic_shrink(env, stat,
+		    HISTOGRAM_SIZE(stat->value.histogram.nbounds));
+	}
+	stat->value.histogram.bounds = b;
+	stat->value.histogram.counts = (unsigned long long *)(b + n);
+	stat->value.histogram.nbounds = n;
+	stat->value.histogram.count = 0;
+	stat->value.histogram.sum = 0;
+	statistic_grow(env, stat, HISTOGRAM_SIZE(n));
+
+	return (0);
+}
+
+/* The bucket a value falls into, the first whose boundary is not less
+ * than it or n if it is above them all. The search halves the range with
+ * a conditional move rather than a branch, so it takes the same steps for
+ * every value and there is nothing for the branch predictor to get wrong
+ */
+size_t
+histogram_bucket(const double *bounds, size_t n, double v)
+{
+	const double	*base = bounds;
+	size_t		 half;
+
+	if (n == 0)
+		return (0);
+
+	while (n > 1) {
+		half = n / 2;
+		base = (base[half - 1] < v) ? base + half : base;
+		n -= half;
+	}
+
+	return ((base - bounds) + (*base < v));
+}
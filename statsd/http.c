@@ -0,0 +1,896 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/keyvalq_struct.h>
+
+#include "statsd.h"
+
+/* State for a list reply being streamed in chunks */
+struct list_reply {
+	struct evhttp_request		*req;
+	struct evhttp_connection	*evcon;
+	struct event			*ev;
+	struct snapshot			*snap;
+	char				*prefix;
+	char				*match;
+	size_t				 next;
+	size_t				 last;
+	long long			 limit;
+	long long			 sent;
+};
+
+size_t		 http_lower_bound(struct snapshot *, enum statistic_type,
+		    const char *);
+char		*list_param(struct evkeyvalq *, const char *);
+void		 list_reply_free(struct list_reply *);
+void		 list_chunk(struct list_reply *);
+void		 list_chunk_cb(struct evhttp_connection *, void *);
+void		 list_timer_cb(int, short, void *);
+void		 list_close_cb(struct evhttp_connection *, void *);
+void		 process_generic_list(struct evhttp_request *, void *,
+		    enum statistic_type);
+void		 process_counter_list(struct evhttp_request *, void *);
+void		 process_timer_list(struct evhttp_request *, void *);
+void		 process_gauge_list(struct evhttp_request *, void *);
+void		 process_set_list(struct evhttp_request *, void *);
+void		 process_histogram_list(struct evhttp_request *, void *);
+void		 timer_summary(struct evbuffer *, struct readings *,
+		    unsigned long long);
+int		 timer_histogram(struct evbuffer *, struct readings *,
+		    unsigned long long, const char *);
+void		 timer_raw(struct evbuffer *, struct readings *);
+int		 timer_view(struct evbuffer *, struct evhttp_request *,
+		    struct readings *, unsigned long long);
+void		 process_generic(struct evhttp_request *, struct statsd *,
+		    enum statistic_type, const char *);
+void		 process_top(struct evhttp_request *, void *);
+void		 top_json(struct evbuffer *, const char *, struct top_item *,
+		    size_t, size_t);
+void		 bad_json(struct evbuffer *, unsigned long long *);
+void		 process_bad(struct evhttp_request *, void *);
+void		 http_gencb(struct evhttp_request *, void *);
+void		 http_command_done_cb(int, short, void *);
+void		 http_listen_cb(int, short, void *);
+void		*http_thread(void *);
+
+struct statistic_dispatch dispatch[STATSD_MAX_TYPE] = {
+	{ "counters", process_counter_list },
+	{ "timers",   process_timer_list   },
+	{ "gauges",   process_gauge_list   },
+	{ "sets",     process_set_list     },
+	{ "histograms", process_histogram_list }
+};
+
+/* Index of the first statistic of the given type whose name is not less
+ * than the one given, each type is a sorted range within the snapshot
+ */
+size_t
+http_lower_bound(struct snapshot *snap, enum statistic_type type,
+    const char *metric)
+{
+	size_t	 lo, hi, mid;
+
+	lo = snap->first[type];
+	hi = snap->first[type + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(snap->stats[mid].metric, metric) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+char *
+list_param(struct evkeyvalq *params, const char *key)
+{
+	const char	*value;
+	char		*copy;
+
+	if ((value = evhttp_find_header(params, key)) == NULL)
+		return (NULL);
+	if ((copy = strdup(value)) == NULL)
+		fatal("strdup");
+
+	return (copy);
+}
+
+void
+list_reply_free(struct list_reply *lr)
+{
+	evhttp_connection_set_closecb(lr->evcon, NULL, NULL);
+	event_free(lr->ev);
+	snapshot_unref(lr->snap);
+	free(lr->prefix);
+	free(lr->match);
+	free(lr);
+}
+
+/* Send the next chunk of metric names from the snapshot */
+void
+list_chunk(struct list_reply *lr)
+{
+	struct evhttp_request	*req = lr->req;
+	struct snapshot_stat	*ss;
+	struct evbuffer		*buf;
+	struct timeval		 tv;
+	int			 i = 0;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		list_reply_free(lr);
+		evhttp_send_reply_end(req);
+		return;
+	}
+
+	for (; lr->next < lr->last && i < STATSD_HTTP_CHUNK &&
+	    (lr->limit < 0 || lr->sent < lr->limit); lr->next++, i++) {
+		ss = &lr->snap->stats[lr->next];
+		/* Sorted, so once past the prefix there's nothing more */
+		if (lr->prefix != NULL && strncmp(ss->metric, lr->prefix,
+		    strlen(lr->prefix))) {
+			lr->last = lr->next;
+			break;
+		}
+		if (lr->match != NULL && fnmatch(lr->match, ss->metric, 0))
+			continue;
+		/* Each set of tags is another statistic with the same name */
+		if (lr->next > lr->snap->first[ss->type] &&
+		    !strcmp(ss[-1].metric, ss->metric))
+			continue;
+		evbuffer_add_printf(buf, "%s\"%s\"", (lr->sent++) ? "," : "",
+		    ss->metric);
+	}
+
+	if (lr->next == lr->last || (lr->limit >= 0 && lr->sent >= lr->limit)) {
+		evbuffer_add_printf(buf, "]\n");
+		evhttp_send_reply_chunk(req, buf);
+		evbuffer_free(buf);
+		list_reply_free(lr);
+		evhttp_send_reply_end(req);
+		return;
+	}
+
+	/* Nothing matched in this chunk so there's nothing to wait to be
+	 * written, just yield to the event loop before carrying on
+	 */
+	if (evbuffer_get_length(buf) == 0) {
+		timerclear(&tv);
+		evtimer_add(lr->ev, &tv);
+	} else
+		evhttp_send_reply_chunk_with_cb(req, buf, list_chunk_cb, lr);
+	evbuffer_free(buf);
+}
+
+void
+list_timer_cb(int fd, short event, void *arg)
+{
+	list_chunk((struct list_reply *)arg);
+}
+
+void
+list_chunk_cb(struct evhttp_connection *evcon, void *arg)
+{
+	list_chunk((struct list_reply *)arg);
+}
+
+void
+list_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+	/* Client went away mid-stream */
+	list_reply_free((struct list_reply *)arg);
+}
+
+void
+process_generic_list(struct evhttp_request *req, void *arg,
+    enum statistic_type type)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct evkeyvalq	 params;
+	struct list_reply	*lr;
+	struct http_command	*cmd;
+	struct evbuffer		*buf;
+	const char		*limit, *after, *errstr = NULL;
+	long long		 n = -1;
+	size_t			 i;
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_GET:
+		/* ?prefix=, ?match=, ?limit= and ?after= */
+		evhttp_parse_query_str(evhttp_uri_get_query(
+		    evhttp_request_get_evhttp_uri(req)), &params);
+		if ((limit = evhttp_find_header(&params, "limit")) != NULL)
+			n = strtonum(limit, 0, LLONG_MAX, &errstr);
+		if (errstr) {
+			evhttp_clear_headers(&params);
+			evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+			return;
+		}
+		if ((lr = calloc(1, sizeof(struct list_reply))) == NULL)
+			fatal("calloc");
+		lr->req = req;
+		lr->evcon = evhttp_request_get_connection(req);
+		lr->ev = evtimer_new(env->http_base, list_timer_cb, lr);
+		lr->snap = snapshot_get(env);
+		lr->limit = n;
+		lr->prefix = list_param(&params, "prefix");
+		lr->match = list_param(&params, "match");
+
+		/* Start from whichever is later of the prefix or cursor */
+		lr->next = lr->snap->first[type];
+		lr->last = lr->snap->first[type + 1];
+		if (lr->prefix != NULL)
+			lr->next = http_lower_bound(lr->snap, type, lr->prefix);
+		if ((after = evhttp_find_header(&params, "after")) != NULL) {
+			i = http_lower_bound(lr->snap, type, after);
+			while (i < lr->last &&
+			    !strcmp(lr->snap->stats[i].metric, after))
+				i++;
+			lr->next = MAX(lr->next, i);
+		}
+		evhttp_clear_headers(&params);
+
+		evhttp_connection_set_closecb(lr->evcon, list_close_cb, lr);
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Content-Type", "application/json");
+		evhttp_send_reply_start(req, HTTP_OK, "OK");
+		if ((buf = evbuffer_new()) == NULL)
+			fatal("evbuffer_new");
+		evbuffer_add_printf(buf, "[");
+		evhttp_send_reply_chunk(req, buf);
+		evbuffer_free(buf);
+		list_chunk(lr);
+		break;
+	case EVHTTP_REQ_DELETE:
+		/* Only ever delete a whole prefix at once, an empty prefix
+		 * is allowed but has to be asked for explicitly
+		 */
+		evhttp_parse_query_str(evhttp_uri_get_query(
+		    evhttp_request_get_evhttp_uri(req)), &params);
+		if ((cmd = calloc(1, sizeof(struct http_command))) == NULL)
+			fatal("calloc");
+		if ((cmd->metric = list_param(&params, "prefix")) == NULL) {
+			evhttp_clear_headers(&params);
+			free(cmd);
+			evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+			return;
+		}
+		evhttp_clear_headers(&params);
+		cmd->req = req;
+		cmd->op = HTTP_COMMAND_DELETE_PREFIX;
+		cmd->type = type;
+		evhttp_request_own(req);
+		http_command_send(env, cmd);
+		break;
+	default:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "GET, DELETE");
+#if 0
+		/* evhttp_send_error() doesn't appear to honour any
+		 * additional headers set, unlike evhttp_send_reply(). RFC
+		 * states we should send back Allow: header.
+		 */
+		evhttp_send_error(req, HTTP_BADMETHOD, "Bad Method");
+#else
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+#endif
+		break;
+	}
+}
+
+void
+process_counter_list(struct evhttp_request *req, void *arg)
+{
+	process_generic_list(req, arg, STATSD_COUNTER);
+}
+
+void
+process_timer_list(struct evhttp_request *req, void *arg)
+{
+	process_generic_list(req, arg, STATSD_TIMER);
+}
+
+void
+process_gauge_list(struct evhttp_request *req, void *arg)
+{
+	process_generic_list(req, arg, STATSD_GAUGE);
+}
+
+void
+process_set_list(struct evhttp_request *req, void *arg)
+{
+	process_generic_list(req, arg, STATSD_SET);
+}
+
+void
+process_histogram_list(struct evhttp_request *req, void *arg)
+{
+	process_generic_list(req, arg, STATSD_HISTOGRAM);
+}
+
+void
+timer_summary(struct evbuffer *buf, struct readings *head,
+    unsigned long long count)
+{
+	static const double	 percentiles[] = { 0.5, 0.9, 0.95, 0.99 };
+	struct reading		*r;
+	long double		 sum = 0, lower = 0, upper = 0;
+	size_t			 i;
+
+	if (!RB_EMPTY(head)) {
+		lower = RB_MIN(readings, head)->value;
+		upper = RB_MAX(readings, head)->value;
+		RB_FOREACH(r, readings, head)
+			sum += r->value * r->count;
+	}
+
+	evbuffer_add_printf(buf,
+	    "\"count\":%llu,\"sum\":%Lf,\"lower\":%Lf,\"upper\":%Lf,"
+	    "\"mean\":%Lf,\"percentiles\":{", count, sum, lower, upper,
+	    (count) ? sum / count : 0);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		evbuffer_add_printf(buf, "%s\"%g\":%Lf", (i) ? "," : "",
+		    percentiles[i] * 100,
+		    readings_quantile(head, count, percentiles[i]));
+	evbuffer_add_printf(buf, "}");
+}
+
+/* Count readings into buckets given as a comma-separated list of
+ * ascending upper bounds, anything above the last bound is counted in a
+ * final +Inf bucket
+ */
+int
+timer_histogram(struct evbuffer *buf, struct readings *head,
+    unsigned long long count, const char *spec)
+{
+	long double		 bounds[STATSD_HTTP_MAX_BUCKETS];
+	unsigned long long	 counts[STATSD_HTTP_MAX_BUCKETS + 1];
+	struct reading		*r;
+	const char		*p;
+	char			*ep;
+	int			 i, n = 0;
+
+	for (p = spec; *p != '\0'; p = ep) {
+		if (n == STATSD_HTTP_MAX_BUCKETS)
+			return (-1);
+		bounds[n] = strtold(p, &ep);
+		if (ep == p || (*ep != ',' && *ep != '\0'))
+			return (-1);
+		if (n > 0 && bounds[n] <= bounds[n - 1])
+			return (-1);
+		n++;
+		if (*ep == ',')
+			ep++;
+	}
+	if (n == 0)
+		return (-1);
+
+	bzero(counts, sizeof(counts));
+
+	/* Readings are sorted so walk the buckets alongside them */
+	i = 0;
+	RB_FOREACH(r, readings, head) {
+		while (i < n && r->value > bounds[i])
+			i++;
+		counts[i] += r->count;
+	}
+
+	evbuffer_add_printf(buf, "\"count\":%llu,\"buckets\":[", count);
+	for (i = 0; i < n; i++)
+		evbuffer_add_printf(buf, "{\"le\":%Lg,\"count\":%llu},",
+		    bounds[i], counts[i]);
+	evbuffer_add_printf(buf, "{\"le\":\"+Inf\",\"count\":%llu}]",
+	    counts[n]);
+
+	return (0);
+}
+
+void
+timer_raw(struct evbuffer *buf, struct readings *head)
+{
+	struct reading		*r;
+	int			 i;
+
+	evbuffer_add_printf(buf, "\"values\":[");
+	RB_FOREACH(r, readings, head) {
+		for (i = 1; i <= r->count; i++) {
+			evbuffer_add_printf(buf, "%Lf", r->value);
+			if (i < r->count)
+				evbuffer_add_printf(buf, ",");
+		}
+		if (RB_NEXT(readings, head, r))
+			evbuffer_add_printf(buf, ",");
+	}
+	evbuffer_add_printf(buf, "]");
+}
+
+/* Timers default to a summary, every reading can be very large so dumping
+ * them all has to be asked for
+ */
+int
+timer_view(struct evbuffer *buf, struct evhttp_request *req,
+    struct readings *head, unsigned long long count)
+{
+	struct evkeyvalq	 params;
+	const char		*view, *buckets;
+	int			 rv = 0;
+
+	evhttp_parse_query_str(evhttp_uri_get_query(
+	    evhttp_request_get_evhttp_uri(req)), &params);
+
+	if ((view = evhttp_find_header(&params, "view")) == NULL ||
+	    !strcmp(view, "summary"))
+		timer_summary(buf, head, count);
+	else if (!strcmp(view, "histogram")) {
+		if ((buckets = evhttp_find_header(&params, "buckets")) == NULL)
+			rv = -1;
+		else
+			rv = timer_histogram(buf, head, count, buckets);
+	} else if (!strcmp(view, "raw"))
+		timer_raw(buf, head);
+	else
+		rv = -1;
+
+	evhttp_clear_headers(&params);
+
+	return (rv);
+}
+
+void
+process_generic(struct evhttp_request *req, struct statsd *env,
+    enum statistic_type type, const char *metric)
+{
+	struct snapshot		*snap;
+	struct snapshot_stat	*ss;
+	struct evbuffer		*buf;
+	struct unique		*u1;
+	struct http_command	*cmd;
+	size_t			 i;
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_GET:
+		snap = snapshot_get(env);
+		/* Untagged statistics sort first */
+		i = http_lower_bound(snap, type, metric);
+		if (i == snap->first[type + 1] ||
+		    strcmp(snap->stats[i].metric, metric) ||
+		    snap->stats[i].tags != NULL) {
+			snapshot_unref(snap);
+			evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+			return;
+		}
+		ss = &snap->stats[i];
+		if ((buf = evbuffer_new()) == NULL) {
+			snapshot_unref(snap);
+			return;
+		}
+		switch (type) {
+		case STATSD_COUNTER:
+			/* FALLTHROUGH */
+		case STATSD_GAUGE:
+			evbuffer_add_printf(buf,
+			    "{\"name\":\"%s\",\"value\":%Lf,\"last_modified\":%lu}\n",
+			    metric, ss->value.count, ss->tv.tv_sec);
+			break;
+		case STATSD_TIMER:
+			evbuffer_add_printf(buf,
+			    "{\"name\":\"%s\",\"last_modified\":%lu,",
+			    metric, ss->tv.tv_sec);
+			if (timer_view(buf, req, &ss->value.timer.readings,
+			    ss->value.timer.count) != 0) {
+				evbuffer_free(buf);
+				snapshot_unref(snap);
+				evhttp_send_error(req, HTTP_BADREQUEST,
+				    "Bad Request");
+				return;
+			}
+			evbuffer_add_printf(buf, "}\n");
+			break;
+		case STATSD_SET:
+			evbuffer_add_printf(buf,
+			    "{\"name\":\"%s\",\"last_modified\":%lu,\"values\":[",
+			    metric, ss->tv.tv_sec);
+			for (u1 = RB_MIN(uniques, &ss->value.set.uniques); u1;
+			    u1 = RB_NEXT(uniques, &ss->value.set.uniques, u1)) {
+				evbuffer_add_printf(buf, "\"%s\"", u1->value);
+				if (RB_NEXT(uniques, &ss->value.set.uniques,
+				    u1))
+					evbuffer_add_printf(buf, ",");
+			}
+			evbuffer_add_printf(buf, "]}\n");
+			break;
+		case STATSD_HISTOGRAM:
+			/* Laid out like a timer's histogram view */
+			evbuffer_add_printf(buf,
+			    "{\"name\":\"%s\",\"last_modified\":%lu,"
+			    "\"count\":%llu,\"sum\":%Lf,\"buckets\":[",
+			    metric, ss->tv.tv_sec, ss->value.histogram.count,
+			    ss->value.histogram.sum);
+			for (i = 0; i < ss->value.histogram.nbounds; i++)
+				evbuffer_add_printf(buf,
+				    "{\"le\":%g,\"count\":%llu},",
+				    ss->value.histogram.bounds[i],
+				    ss->value.histogram.counts[i]);
+			evbuffer_add_printf(buf,
+			    "{\"le\":\"+Inf\",\"count\":%llu}]}\n",
+			    ss->value.histogram.counts[i]);
+			break;
+		default:
+			/* Shouldn't ever happen, return empty JSON object */
+			evbuffer_add_printf(buf, "{}\n");
+			break;
+		}
+		snapshot_unref(snap);
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Content-Type", "application/json");
+		evhttp_send_reply(req, HTTP_OK, "OK", buf);
+		evbuffer_free(buf);
+		break;
+	case EVHTTP_REQ_DELETE:
+		/* The live statistics belong to the ingest thread so hand
+		 * the request over and reply once it's been done
+		 */
+		if ((cmd = calloc(1, sizeof(struct http_command))) == NULL ||
+		    (cmd->metric = strdup(metric)) == NULL)
+			fatal("calloc");
+		cmd->req = req;
+		cmd->type = type;
+		evhttp_request_own(req);
+		http_command_send(env, cmd);
+		break;
+	default:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "GET, DELETE");
+#if 0
+		/* evhttp_send_error() doesn't appear to honour any
+		 * additional headers set, unlike evhttp_send_reply(). RFC
+		 * states we should send back Allow: header.
+		 */
+		evhttp_send_error(req, HTTP_BADMETHOD, "Bad Method");
+#else
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+#endif
+		break;
+	}
+}
+
+void
+top_json(struct evbuffer *buf, const char *name, struct top_item *items,
+    size_t count, size_t limit)
+{
+	size_t	 i;
+
+	evbuffer_add_printf(buf, "\"%s\":[", name);
+	for (i = 0; i < MIN(count, limit); i++)
+		evbuffer_add_printf(buf,
+		    "%s{\"key\":\"%s\",\"count\":%llu,\"error\":%llu}",
+		    (i > 0) ? "," : "", items[i].key, items[i].count,
+		    items[i].error);
+	evbuffer_add_printf(buf, "]");
+}
+
+/* The busiest metrics and senders over the last interval. Counts are
+ * upper bounds, each at most "error" more than the true figure
+ */
+void
+process_top(struct evhttp_request *req, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct evkeyvalq	 params;
+	struct snapshot		*snap;
+	struct evbuffer		*buf;
+	const char		*limit, *errstr = NULL;
+	long long		 n = STATSD_TOP_SIZE;
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_GET:
+		evhttp_parse_query_str(evhttp_uri_get_query(
+		    evhttp_request_get_evhttp_uri(req)), &params);
+		if ((limit = evhttp_find_header(&params, "limit")) != NULL)
+			n = strtonum(limit, 0, STATSD_TOP_SIZE, &errstr);
+		evhttp_clear_headers(&params);
+		if (errstr) {
+			evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+			return;
+		}
+		if ((buf = evbuffer_new()) == NULL)
+			return;
+		snap = snapshot_get(env);
+		evbuffer_add_printf(buf, "{");
+		top_json(buf, "metrics", snap->top[TOP_METRICS],
+		    snap->ntop[TOP_METRICS], n);
+		evbuffer_add_printf(buf, ",");
+		top_json(buf, "sources", snap->top[TOP_SOURCES],
+		    snap->ntop[TOP_SOURCES], n);
+		evbuffer_add_printf(buf, "}\n");
+		snapshot_unref(snap);
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Content-Type", "application/json");
+		evhttp_send_reply(req, HTTP_OK, "OK", buf);
+		evbuffer_free(buf);
+		break;
+	default:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "GET");
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+		break;
+	}
+}
+
+void
+bad_json(struct evbuffer *buf, unsigned long long *bad)
+{
+	int	 i;
+
+	evbuffer_add_printf(buf, "{");
+	for (i = 0; i < BAD_MAX; i++)
+		evbuffer_add_printf(buf, "%s\"%s\":%llu", (i > 0) ? "," : "",
+		    bad_names[i], bad[i]);
+	evbuffer_add_printf(buf, "}");
+}
+
+/* Lines rejected since startup by reason, in total and per listening
+ * socket, along with who sent the most of them over the last interval
+ */
+void
+process_bad(struct evhttp_request *req, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct snapshot		*snap;
+	struct evbuffer		*buf;
+	size_t			 i;
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_GET:
+		if ((buf = evbuffer_new()) == NULL)
+			return;
+		snap = snapshot_get(env);
+		evbuffer_add_printf(buf, "{\"reasons\":");
+		bad_json(buf, snap->bad);
+		evbuffer_add_printf(buf, ",\"listeners\":[");
+		for (i = 0; i < snap->nlisteners; i++) {
+			evbuffer_add_printf(buf,
+			    "%s{\"address\":\"%s\",\"reasons\":",
+			    (i > 0) ? "," : "", snap->listeners[i].name);
+			bad_json(buf, snap->listeners[i].bad);
+			evbuffer_add_printf(buf, "}");
+		}
+		evbuffer_add_printf(buf, "],");
+		top_json(buf, "sources", snap->top[TOP_BAD],
+		    snap->ntop[TOP_BAD], STATSD_TOP_SIZE);
+		evbuffer_add_printf(buf, "}\n");
+		snapshot_unref(snap);
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Content-Type", "application/json");
+		evhttp_send_reply(req, HTTP_OK, "OK", buf);
+		evbuffer_free(buf);
+		break;
+	default:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "GET");
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+		break;
+	}
+}
+
+/* Anything not matched exactly lands here, which covers every single
+ * metric URL of the form "/<type>/<metric>"
+ */
+void
+http_gencb(struct evhttp_request *req, void *arg)
+{
+	struct statsd	*env = (struct statsd *)arg;
+	const char	*path;
+	size_t		 len;
+	int		 i;
+
+	path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	for (i = 0; path != NULL && *path == '/' && i < STATSD_MAX_TYPE;
+	    i++) {
+		len = strlen(dispatch[i].path);
+		if (!strncmp(path + 1, dispatch[i].path, len) &&
+		    path[len + 1] == '/' && path[len + 2] != '\0') {
+			process_generic(req, env, i, path + len + 2);
+			return;
+		}
+	}
+
+	evhttp_send_error(req, HTTP_NOTFOUND, "Not Found");
+}
+
+/* Pass a command to the ingest thread */
+void
+http_command_send(struct statsd *env, struct http_command *cmd)
+{
+	pthread_mutex_lock(&env->cmd_mtx);
+	TAILQ_INSERT_TAIL(&env->cmd_queue, cmd, entry);
+	pthread_mutex_unlock(&env->cmd_mtx);
+	event_active(env->cmd_ev, EV_READ, 0);
+}
+
+/* Pass a finished command back to the HTTP thread */
+void
+http_command_done(struct statsd *env, struct http_command *cmd)
+{
+	pthread_mutex_lock(&env->cmd_mtx);
+	TAILQ_INSERT_TAIL(&env->cmd_done, cmd, entry);
+	pthread_mutex_unlock(&env->cmd_mtx);
+	event_active(env->cmd_done_ev, EV_READ, 0);
+}
+
+void
+http_command_done_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct http_commands	 done;
+	struct http_command	*cmd;
+	struct evbuffer		*buf;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&env->cmd_mtx);
+	TAILQ_CONCAT(&done, &env->cmd_done, entry);
+	pthread_mutex_unlock(&env->cmd_mtx);
+
+	while ((cmd = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, cmd, entry);
+		switch (cmd->op) {
+		case HTTP_COMMAND_DELETE:
+			if (cmd->result > 0)
+				evhttp_send_reply(cmd->req, HTTP_NOCONTENT,
+				    "No Content", NULL);
+			else
+				evhttp_send_error(cmd->req, HTTP_NOTFOUND,
+				    "Not Found");
+			break;
+		case HTTP_COMMAND_DELETE_PREFIX:
+			if ((buf = evbuffer_new()) == NULL)
+				fatal("evbuffer_new");
+			evbuffer_add_printf(buf, "{\"deleted\":%llu}\n",
+			    cmd->result);
+			evhttp_add_header(evhttp_request_get_output_headers(
+			    cmd->req), "Content-Type", "application/json");
+			evhttp_send_reply(cmd->req, HTTP_OK, "OK", buf);
+			evbuffer_free(buf);
+			break;
+		}
+		free(cmd->metric);
+		free(cmd);
+	}
+}
+
+/* Stop or start accepting connections. The listener belongs to the HTTP
+ * thread so it is switched over there
+ */
+void
+http_listen(struct statsd *env, int on)
+{
+	pthread_mutex_lock(&env->cmd_mtx);
+	env->http_listening = on;
+	pthread_mutex_unlock(&env->cmd_mtx);
+	event_active(env->http_listen_ev, EV_READ, 0);
+}
+
+void
+http_listen_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct evconnlistener	*lev;
+	int			 on;
+
+	pthread_mutex_lock(&env->cmd_mtx);
+	on = env->http_listening;
+	pthread_mutex_unlock(&env->cmd_mtx);
+
+	lev = evhttp_bound_socket_get_listener(env->http_bound);
+	if (on)
+		evconnlistener_enable(lev);
+	else
+		evconnlistener_disable(lev);
+}
+
+void *
+http_thread(void *arg)
+{
+	struct statsd	*env = (struct statsd *)arg;
+
+	/* Keep going while the listener is switched off for an upgrade */
+	event_base_loop(env->http_base, EVLOOP_NO_EXIT_ON_EMPTY);
+
+	return (NULL);
+}
+
+/* The HTTP server runs on its own thread and event base, only ever
+ * looking at published snapshots so it can't hold up reading packets
+ */
+void
+http_init(struct statsd *env)
+{
+	struct event_config		*cfg;
+	char				*path;
+	int				 i;
+
+	if ((cfg = event_config_new()) == NULL)
+		fatalx("event_config_new");
+
+#ifdef __APPLE__
+	/* Don't use kqueue(2) on OS X */
+	event_config_avoid_method(cfg, "kqueue");
+#endif
+
+	env->http_base = event_base_new_with_config(cfg);
+	if (!env->http_base)
+		fatalx("event_base_new_with_config");
+	event_config_free(cfg);
+
+	if ((env->httpd = evhttp_new(env->http_base)) == NULL)
+		fatalx("evhttp_new");
+	if (env->http_fd != -1) {
+		/* Handed over by the previous process */
+		if ((env->http_bound = evhttp_accept_socket_with_handle(
+		    env->httpd, env->http_fd)) == NULL)
+			fatalx("evhttp_accept_socket");
+	} else {
+		if ((env->http_bound = evhttp_bind_socket_with_handle(
+		    env->httpd, "0.0.0.0", STATSD_DEFAULT_HTTP_PORT)) == NULL)
+			fatalx("evhttp_bind_socket");
+		env->http_fd = evhttp_bound_socket_get_fd(env->http_bound);
+	}
+	env->http_listening = 1;
+	/* Only care about GET & DELETE methods */
+	evhttp_set_allowed_methods(env->httpd,
+	    EVHTTP_REQ_GET|EVHTTP_REQ_DELETE);
+	for (i = 0; i < STATSD_MAX_TYPE; i++) {
+		if ((path = calloc(strlen(dispatch[i].path) + 2,
+		    sizeof(char))) == NULL)
+			fatal("calloc");
+		sprintf(path, "/%s", dispatch[i].path);
+		evhttp_set_cb(env->httpd, path, dispatch[i].list_cb,
+		    (void *)env);
+		free(path);
+	}
+	prometheus_init();
+	evhttp_set_cb(env->httpd, "/metrics", process_prometheus, (void *)env);
+	evhttp_set_cb(env->httpd, "/internal/top", process_top, (void *)env);
+	evhttp_set_cb(env->httpd, "/internal/errors", process_bad, (void *)env);
+	evhttp_set_gencb(env->httpd, http_gencb, (void *)env);
+
+	env->cmd_done_ev = event_new(env->http_base, -1, 0,
+	    http_command_done_cb, (void *)env);
+	env->http_listen_ev = event_new(env->http_base, -1, 0,
+	    http_listen_cb, (void *)env);
+}
+
+void
+http_start(struct statsd *env)
+{
+	if (pthread_create(&env->http_tid, NULL, http_thread, env) != 0)
+		fatalx("pthread_create");
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* The limit prefixes are kept in a trie, one node per character, so
+ * finding the rule for a metric costs one walk down its name no matter
+ * how many rules there are. A metric is counted against the longest
+ * prefix that matches it
+ */
+struct limit_node {
+	struct limit_node	*child;
+	struct limit_node	*next;
+	struct limit		*limit;
+	unsigned char		 c;
+};
+
+void		 limit_node_free(struct limit_node *);
+
+void
+limit_node_free(struct limit_node *node)
+{
+	struct limit_node	*next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		limit_node_free(node->child);
+		free(node);
+	}
+}
+
+void
+limit_free(struct statsd *env)
+{
+	struct limit	*l;
+
+	limit_node_free(env->limit_root);
+	env->limit_root = NULL;
+
+	while ((l = TAILQ_FIRST(&env->limits)) != NULL) {
+		TAILQ_REMOVE(&env->limits, l, entry);
+		free(l->prefix);
+		free(l->overflow);
+		free(l);
+	}
+}
+
+/* Build the trie from the configured rules and count what's already
+ * under each prefix
+ */
+void
+limit_index(struct statsd *env)
+{
+	struct limit		*l;
+	struct limit_node	**np, *node;
+	struct statistic	*stat;
+	const unsigned char	*p;
+
+	limit_node_free(env->limit_root);
+	env->limit_root = NULL;
+
+	TAILQ_FOREACH(l, &env->limits, entry) {
+		node = NULL;
+		np = &env->limit_root;
+		for (p = (unsigned char *)l->prefix; *p != '\0'; p++) {
+			for (; *np != NULL; np = &(*np)->next)
+				if ((*np)->c == *p)
+					break;
+			if (*np == NULL) {
+				if ((*np = calloc(1,
+				    sizeof(struct limit_node))) == NULL)
+					fatal("calloc");
+				(*np)->c = *p;
+			}
+			node = *np;
+			np = &node->child;
+		}
+		if (node == NULL)
+			continue;
+		if (node->limit != NULL)
+			log_warnx("duplicate limit for \"%s\"", l->prefix);
+		node->limit = l;
+		l->count = 0;
+	}
+
+	RB_FOREACH(stat, statistics, &env->stats)
+		if ((stat->limit = limit_find(env, stat->metric)) != NULL) {
+			if (!strcmp(stat->metric, stat->limit->overflow))
+				stat->limit = NULL;
+			else
+				stat->limit->count++;
+		}
+}
+
+struct limit *
+limit_find(struct statsd *env, const char *metric)
+{
+	struct limit_node	*node = env->limit_root;
+	struct limit		*l = NULL;
+	const unsigned char	*p;
+
+	for (p = (const unsigned char *)metric; *p != '\0' && node != NULL;
+	    p++) {
+		for (; node != NULL; node = node->next)
+			if (node->c == *p)
+				break;
+		if (node == NULL)
+			break;
+		if (node->limit != NULL)
+			l = node->limit;
+		node = node->child;
+	}
+
+	return (l);
+}
+
+/* Find or create the statistic that samples are folded into once the
+ * limit is reached. It doesn't count towards the limit itself but can
+ * belong to an aggregate like any other statistic
+ */
+struct statistic *
+limit_overflow(struct statsd *env, struct limit *l, enum statistic_type type)
+{
+	struct statistic	*stat;
+	struct statistic	 find;
+
+	find.metric = l->overflow;
+	find.tags = NULL;
+	if ((stat = RB_FIND(statistics, &env->stats, &find)) == NULL) {
+		if ((stat = statistic_new(env, l->overflow, NULL,
+		    type)) == NULL)
+			return (NULL);
+		l->count--;
+		stat->limit = NULL;
+		aggregate_join(env, stat);
+	}
+
+	return ((stat->type == type) ? stat : NULL);
+}
@@ -63,15 +63,24 @@ struct opts {
 	int		 reconnect;
 	char		*prefix;
 	int		 interval;
+	int		 slice;
+	int		 tags;
 	int		 flags;
 } opts;
 void		 opts_default(void);
+struct rule	*rule_add(char *, char *, enum rule_action);
+
+double		 bounds[STATSD_HISTOGRAM_MAX_BOUNDS];
+size_t		 nbounds;
+
+struct rollups	 rollups;
 
 /* FIXME */
 #define YYSTYPE_IS_DECLARED 1
 typedef struct {
 	union {
 		int64_t				 number;
+		double				 decimal;
 		char				*string;
 		struct statsd_addr_wrap		*addr;
 		struct opts			 opts;
@@ -82,10 +91,17 @@ typedef struct {
 %}
 
 %token	LISTEN ON
+%token	CHECKPOINT UPGRADE
+%token	MAXMEMORY
+%token	LIMIT DROP OVERFLOW
+%token	HISTOGRAM BUCKETS
+%token	REWRITE AGGREGATE SUM MAX SUPPRESS
+%token	LOG ASYNC RATE BURST
 %token	GRAPHITE
 %token	STATISTICS INTERVAL PREFIX
 %token	PORT
-%token	RECONNECT
+%token	RECONNECT SLICE
+%token	TAGS PATH
 %token	ERROR
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
@@ -93,10 +109,18 @@ typedef struct {
 %type	<v.opts>		listen_opts listen_opts_l listen_opt
 %type	<v.opts>		graphite_opts graphite_opts_l graphite_opt
 %type	<v.opts>		stats_opts stats_opts_l stats_opt
+%type	<v.opts>		checkpoint_opts checkpoint_opts_l checkpoint_opt
 %type	<v.opts>		port
 %type	<v.opts>		reconnect
 %type	<v.opts>		interval
+%type	<v.opts>		slice
+%type	<v.opts>		tags
 %type	<v.opts>		prefix
+%type	<v.number>		size
+%type	<v.number>		limit_action
+%type	<v.number>		aggregate_op suppress
+%type	<v.decimal>		decimal
+%type	<v.string>		rollup_prefix
 %%
 
 grammar		: /* empty */
@@ -124,6 +148,7 @@ main		: LISTEN ON address listen_opts	{
 					fatal("listen on calloc");
 				la->port =
 				    (opts.port) ? opts.port : GRAPHITE_DEFAULT_PORT;
+				la->fd = -1;
 				memcpy(&la->sa, &h->ss,
 				    sizeof(struct sockaddr_storage));
 				TAILQ_INSERT_TAIL(&conf->listen_addrs, la,
@@ -140,6 +165,10 @@ main		: LISTEN ON address listen_opts	{
 			conf->graphite_port = opts.port;
 			conf->graphite_reconnect.tv_sec = opts.reconnect;
 			conf->graphite_interval.tv_sec = opts.interval;
+			conf->graphite_slice = opts.slice;
+			conf->graphite_tags = opts.tags;
+			rollup_free(conf);
+			TAILQ_CONCAT(&conf->rollups, &rollups, entry);
 		}
 		| STATISTICS STRING stats_opts	{
 			if (conf->stats_host)
@@ -152,6 +181,79 @@ main		: LISTEN ON address listen_opts	{
 				free(conf->stats_prefix);
 			conf->stats_prefix = opts.prefix;
 		}
+		| CHECKPOINT STRING checkpoint_opts	{
+			if (conf->checkpoint_path)
+				free(conf->checkpoint_path);
+			conf->checkpoint_path = $2;
+			conf->checkpoint_interval.tv_sec = opts.interval;
+		}
+		| LIMIT STRING NUMBER limit_action	{
+			struct limit	*l;
+
+			if ($3 <= 0) {
+				yyerror("invalid limit");
+				free($2);
+				YYERROR;
+			}
+			if ($2[0] == '\0') {
+				yyerror("empty limit prefix");
+				free($2);
+				YYERROR;
+			}
+			if ((l = calloc(1, sizeof(struct limit))) == NULL)
+				fatal("limit calloc");
+			l->prefix = $2;
+			l->max = $3;
+			l->action = $4;
+			if (asprintf(&l->overflow, "%soverflow", $2) == -1)
+				fatal("asprintf");
+			TAILQ_INSERT_TAIL(&conf->limits, l, entry);
+		}
+		| HISTOGRAM STRING BUCKETS '{' { nbounds = 0; } bucket_l '}' {
+			struct histogram	*h;
+
+			if ((h = calloc(1, sizeof(struct histogram))) == NULL ||
+			    (h->bounds = calloc(nbounds,
+			    sizeof(double))) == NULL)
+				fatal("histogram calloc");
+			h->pattern = $2;
+			memcpy(h->bounds, bounds, nbounds * sizeof(double));
+			h->nbounds = nbounds;
+			TAILQ_INSERT_TAIL(&conf->histograms, h, entry);
+		}
+		| DROP STRING			{
+			if (rule_add($2, NULL, RULE_DROP) == NULL) {
+				free($2);
+				YYERROR;
+			}
+		}
+		| REWRITE STRING STRING		{
+			if (rule_add($2, $3, RULE_REWRITE) == NULL) {
+				free($2);
+				free($3);
+				YYERROR;
+			}
+		}
+		| AGGREGATE STRING STRING aggregate_op suppress	{
+			struct rule	*r;
+
+			if ((r = rule_add($2, $3, RULE_AGGREGATE)) == NULL) {
+				free($2);
+				free($3);
+				YYERROR;
+			}
+			r->op = $4;
+			r->suppress = $5;
+		}
+		| LOG log_opts_l
+		| MAXMEMORY size		{
+			conf->max_memory = $2;
+		}
+		| UPGRADE STRING		{
+			if (conf->upgrade_path)
+				free(conf->upgrade_path);
+			conf->upgrade_path = $2;
+		}
 		;
 
 address		: STRING		{
@@ -190,7 +292,50 @@ graphite_opts_l	: graphite_opts_l graphite_opt
 		;
 graphite_opt	: port
 		| reconnect
-		| interval
+		| interval rollup_l
+		| slice
+		| tags
+		;
+
+rollup_l	: /* empty */
+		| rollup_l rollup
+		;
+rollup		: NUMBER rollup_prefix	{
+			struct rollup	*r;
+
+			if (opts.interval == 0 || $1 <= opts.interval ||
+			    $1 % opts.interval || $1 > UINT_MAX) {
+				yyerror("interval %lld must be a longer "
+				    "multiple of %d", (long long)$1,
+				    opts.interval);
+				free($2);
+				YYERROR;
+			}
+			TAILQ_FOREACH(r, &rollups, entry)
+				if (r->interval.tv_sec == $1) {
+					yyerror("duplicate interval %lld",
+					    (long long)$1);
+					free($2);
+					YYERROR;
+				}
+			if ((r = calloc(1, sizeof(struct rollup))) == NULL)
+				fatal("rollup calloc");
+			r->interval.tv_sec = $1;
+			r->every = $1 / opts.interval;
+			RB_INIT(&r->stats);
+			/* Sent under "60s." and so on unless given a prefix */
+			if ($2 != NULL) {
+				if (asprintf(&r->prefix, "%s.", $2) == -1)
+					fatal("asprintf");
+				free($2);
+			} else if (asprintf(&r->prefix, "%llds.",
+			    (long long)$1) == -1)
+				fatal("asprintf");
+			TAILQ_INSERT_TAIL(&rollups, r, entry);
+		}
+		;
+rollup_prefix	: /* empty */		{ $$ = NULL; }
+		| PREFIX STRING		{ $$ = $2; }
 		;
 
 stats_opts	:	{ opts_default(); }
@@ -207,6 +352,128 @@ stats_opt	: port
 		| prefix
 		;
 
+checkpoint_opts	:	{ opts_default(); }
+		  checkpoint_opts_l
+			{ $$ = opts; }
+		|	{ opts_default(); $$ = opts; }
+		;
+checkpoint_opts_l	: checkpoint_opts_l checkpoint_opt
+		| checkpoint_opt
+		;
+checkpoint_opt	: interval
+		;
+
+log_opts_l	: log_opts_l log_opt
+		| log_opt
+		;
+log_opt		: ASYNC			{ conf->log_async = 1; }
+		| RATE NUMBER		{
+			if ($2 < 0 || $2 > UINT_MAX) {
+				yyerror("invalid rate");
+				YYERROR;
+			}
+			conf->log_limit.rate = $2;
+		}
+		| BURST NUMBER		{
+			if ($2 < 1 || $2 > UINT_MAX) {
+				yyerror("invalid burst");
+				YYERROR;
+			}
+			conf->log_limit.burst = $2;
+		}
+		;
+
+bucket_l	: bucket_l optcomma bucket
+		| bucket
+		;
+bucket		: decimal		{
+			if (nbounds == STATSD_HISTOGRAM_MAX_BOUNDS) {
+				yyerror("too many buckets");
+				YYERROR;
+			}
+			if (nbounds > 0 && $1 <= bounds[nbounds - 1]) {
+				yyerror("buckets must be in ascending order");
+				YYERROR;
+			}
+			bounds[nbounds++] = $1;
+		}
+		;
+optcomma	: ','
+		| /* empty */
+		;
+
+decimal		: NUMBER		{ $$ = $1; }
+		| STRING		{
+			char	*ep;
+
+			/* Anything with a decimal point lexes as a string */
+			$$ = strtod($1, &ep);
+			if (ep == $1 || *ep != '\0' || $$ != $$) {
+				yyerror("invalid number \"%s\"", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+aggregate_op	: /* empty */		{ $$ = AGGREGATE_SUM; }
+		| SUM			{ $$ = AGGREGATE_SUM; }
+		| MAX			{ $$ = AGGREGATE_MAX; }
+		;
+
+suppress	: /* empty */		{ $$ = 0; }
+		| SUPPRESS		{ $$ = 1; }
+		;
+
+limit_action	: /* empty */		{ $$ = LIMIT_DROP; }
+		| DROP			{ $$ = LIMIT_DROP; }
+		| OVERFLOW		{ $$ = LIMIT_OVERFLOW; }
+		;
+
+size		: NUMBER			{
+			if ($1 < 0) {
+				yyerror("invalid size");
+				YYERROR;
+			}
+			$$ = $1;
+		}
+		| STRING			{
+			char		*ep;
+			long long	 n;
+
+			/* A number with a K, M or G suffix */
+			errno = 0;
+			n = strtoll($1, &ep, 10);
+			if (errno || n < 0 || ep == $1 || ep[0] == '\0' ||
+			    ep[1] != '\0') {
+				yyerror("invalid size \"%s\"", $1);
+				free($1);
+				YYERROR;
+			}
+			switch (ep[0]) {
+			case 'G':
+			case 'g':
+				n *= 1024;
+				/* FALLTHROUGH */
+			case 'M':
+			case 'm':
+				n *= 1024;
+				/* FALLTHROUGH */
+			case 'K':
+			case 'k':
+				n *= 1024;
+				break;
+			default:
+				yyerror("invalid size \"%s\"", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+			$$ = n;
+		}
+		;
+
 port		: PORT NUMBER {
 			if ($2 < 0 || $2 > USHRT_MAX) {
 				yyerror("invalid port number");
@@ -234,6 +501,19 @@ interval	: INTERVAL NUMBER {
 		}
 		;
 
+slice		: SLICE NUMBER {
+			if ($2 <= 0 || $2 > UINT_MAX) {
+				yyerror("invalid slice");
+				YYERROR;
+			}
+			opts.slice = $2;
+		}
+		;
+
+tags		: TAGS GRAPHITE		{ opts.tags = TAGS_GRAPHITE; }
+		| TAGS PATH		{ opts.tags = TAGS_PATH; }
+		;
+
 prefix		: PREFIX STRING {
 			opts.prefix = $2;
 		}
@@ -247,6 +527,49 @@ opts_default(void)
 	bzero(&opts, sizeof opts);
 }
 
+/* A rewrite or aggregate can only use what the pattern's wildcards
+ * capture
+ */
+struct rule *
+rule_add(char *pattern, char *replace, enum rule_action action)
+{
+	struct rule	*r;
+	const char	*p;
+	int		 stars = 0;
+
+	if (pattern[0] == '\0') {
+		yyerror("empty rule pattern");
+		return (NULL);
+	}
+	for (p = pattern; *p != '\0'; p++)
+		if (*p == '*') {
+			stars++;
+			if (p[1] == '*')
+				p++;
+		}
+	if (replace != NULL) {
+		if (replace[0] == '\0') {
+			yyerror("empty name for \"%s\"", pattern);
+			return (NULL);
+		}
+		for (p = replace; *p != '\0'; p++)
+			if (*p == '$' && p[1] >= '1' && p[1] <= '9' &&
+			    p[1] - '0' > MIN(stars, RULE_MAX_CAPTURES)) {
+				yyerror("\"%s\" has no $%c", pattern, p[1]);
+				return (NULL);
+			}
+	}
+
+	if ((r = calloc(1, sizeof(struct rule))) == NULL)
+		fatal("rule calloc");
+	r->pattern = pattern;
+	r->replace = replace;
+	r->action = action;
+	TAILQ_INSERT_TAIL(&conf->rules, r, entry);
+
+	return (r);
+}
+
 struct keywords {
 	const char	*k_name;
 	int		 k_val;
@@ -279,14 +602,34 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "aggregate",		AGGREGATE},
+		{ "async",		ASYNC},
+		{ "buckets",		BUCKETS},
+		{ "burst",		BURST},
+		{ "checkpoint",		CHECKPOINT},
+		{ "drop",		DROP},
 		{ "graphite",		GRAPHITE},
+		{ "histogram",		HISTOGRAM},
 		{ "interval",		INTERVAL},
+		{ "limit",		LIMIT},
 		{ "listen",		LISTEN},
+		{ "log",		LOG},
+		{ "max",		MAX},
+		{ "max-memory",		MAXMEMORY},
 		{ "on",			ON},
+		{ "overflow",		OVERFLOW},
+		{ "path",		PATH},
 		{ "port",		PORT},
 		{ "prefix",		PREFIX},
+		{ "rate",		RATE},
 		{ "reconnect",		RECONNECT},
-		{ "statistics",		STATISTICS}
+		{ "rewrite",		REWRITE},
+		{ "slice",		SLICE},
+		{ "statistics",		STATISTICS},
+		{ "sum",		SUM},
+		{ "suppress",		SUPPRESS},
+		{ "tags",		TAGS},
+		{ "upgrade",		UPGRADE}
 	};
 	const struct keywords	*p;
 
@@ -566,8 +909,10 @@ parse_config(const char *filename, int flags)
 		return (NULL);
 	}
 
-	TAILQ_INIT(&conf->listen_addrs);
-	RB_INIT(&conf->stats);
+	statsd_env_init(conf);
+	TAILQ_INIT(&rollups);
+	conf->log_limit.rate = STATSD_DEFAULT_LOG_RATE;
+	conf->log_limit.burst = STATSD_DEFAULT_LOG_BURST;
 
 	if ((file = pushfile(filename)) == NULL) {
 		free(conf);
@@ -597,6 +942,8 @@ parse_config(const char *filename, int flags)
 		conf->graphite_reconnect.tv_sec = 10;
 	if (conf->graphite_interval.tv_sec == 0)
 		conf->graphite_interval.tv_sec = 60;
+	if (conf->graphite_slice == 0)
+		conf->graphite_slice = STATSD_DEFAULT_FLUSH_SLICE;
 
 	/* Statistics */
 	if (conf->stats_host == NULL)
@@ -617,6 +964,11 @@ parse_config(const char *filename, int flags)
 		sprintf(conf->stats_prefix, "%s.statsd", hostname);
 	}
 
+	/* Checkpoint */
+	if (conf->checkpoint_path != NULL &&
+	    conf->checkpoint_interval.tv_sec == 0)
+		conf->checkpoint_interval.tv_sec = 60;
+
 	return (conf);
 }
 
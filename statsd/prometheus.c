@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "statsd.h"
+
+/* One of the names a family is sent under, metric names that only differ
+ * in characters Prometheus doesn't allow end up the same once sanitised
+ */
+struct prometheus_key {
+	const char	*metric;
+	const char	*suffix;
+	size_t		 index;		/* in the order they were made */
+};
+
+/* State for a /metrics reply being streamed in chunks */
+struct prometheus_reply {
+	struct evhttp_request		*req;
+	struct evhttp_connection	*evcon;
+	struct snapshot			*snap;
+	size_t				 next;
+	char				 name[BUFSIZ];
+};
+
+int	 prometheus_next(const char **, const char **, int *);
+int	 prometheus_key_cmp(const void *, const void *);
+void	 prometheus_name(char *, size_t, const char *);
+size_t	 prometheus_suffixes(enum statistic_type, const char ***);
+void	 prometheus_clashes(struct snapshot *);
+void	 prometheus_labels(struct evbuffer *, const char *, const char *,
+	    const char *);
+void	 prometheus_stat(struct evbuffer *, struct snapshot_stat *,
+	    const char *, int, struct timeval);
+void	 prometheus_chunk(struct prometheus_reply *);
+void	 prometheus_chunk_cb(struct evhttp_connection *, void *);
+void	 prometheus_close_cb(struct evhttp_connection *, void *);
+void	 prometheus_reply_free(struct prometheus_reply *);
+
+static const double	 prometheus_quantiles[] = { 0.5, 0.9, 0.99 };
+
+/* Maps every byte to the character used for it in a metric name */
+static char		 prometheus_charmap[256];
+
+void
+prometheus_init(void)
+{
+	int	 c;
+
+	for (c = 0; c < 256; c++)
+		prometheus_charmap[c] = (isalnum(c) || c == '_' || c == ':') ?
+		    (char)c : '_';
+}
+
+/* The next character of a sanitised name and suffix, 0 at the end */
+int
+prometheus_next(const char **p, const char **suffix, int *lead)
+{
+	if (*lead) {
+		*lead = 0;
+		return ('_');
+	}
+	if (**p != '\0')
+		return ((unsigned char)prometheus_charmap[
+		    (unsigned char)*(*p)++]);
+	if (**suffix != '\0')
+		return ((unsigned char)*(*suffix)++);
+
+	return (0);
+}
+
+/* Compare two names as they are sent, without building either */
+int
+prometheus_key_cmp(const void *a, const void *b)
+{
+	const struct prometheus_key	*k1 = a, *k2 = b;
+	const char			*p1 = k1->metric, *s1 = k1->suffix;
+	const char			*p2 = k2->metric, *s2 = k2->suffix;
+	int				 l1, l2, c1, c2;
+
+	l1 = isdigit((unsigned char)*p1);
+	l2 = isdigit((unsigned char)*p2);
+	do {
+		c1 = prometheus_next(&p1, &s1, &l1);
+		c2 = prometheus_next(&p2, &s2, &l2);
+	} while (c1 == c2 && c1 != 0);
+
+	return (c1 - c2);
+}
+
+void
+prometheus_name(char *name, size_t len, const char *metric)
+{
+	const char	*p;
+	size_t		 i = 0;
+
+	/* Names can't begin with a digit */
+	if (isdigit((unsigned char)*metric))
+		name[i++] = '_';
+	for (p = metric; *p != '\0' && i < len - 1; p++)
+		name[i++] = prometheus_charmap[(unsigned char)*p];
+	name[i] = '\0';
+}
+
+/* Every name a family is sent under, the family itself and the series a
+ * summary or histogram adds
+ */
+size_t
+prometheus_suffixes(enum statistic_type type, const char ***suffix)
+{
+	static const char	*summary[] = { "", "_sum", "_count" };
+	static const char	*histogram[] = {
+	    "", "_bucket", "_sum", "_count"
+	};
+
+	*suffix = summary;
+	if (type == STATSD_TIMER)
+		return (3);
+	if (type == STATSD_HISTOGRAM) {
+		*suffix = histogram;
+		return (4);
+	}
+
+	return (1);
+}
+
+/* Mark every family that uses a name already taken by one before it in the
+ * snapshot, by another metric that sanitises the same or by another type.
+ * It is left out rather than the scrape being rejected. This is done once
+ * for each snapshot by the first scrape of it: the names are sorted so
+ * equal ones sit together, then the families are taken in order, each
+ * claiming its names unless one of them was claimed already
+ */
+void
+prometheus_clashes(struct snapshot *snap)
+{
+	struct prometheus_key	*keys;
+	struct snapshot_stat	*ss;
+	const char		**suffix;
+	size_t			*group, ngroups = 0, nkeys = 0, i, j, k, n;
+	unsigned char		*claimed;
+	int			 clash;
+
+	snap->clashes = 1;
+
+	/* At most four names for each statistic */
+	if (snap->count == 0 ||
+	    (keys = calloc(snap->count * 4, sizeof(*keys))) == NULL)
+		return;
+	for (i = 0; i < snap->count; i++) {
+		ss = &snap->stats[i];
+		if (i > 0 && ss[-1].type == ss->type &&
+		    !strcmp(ss[-1].metric, ss->metric))
+			continue;
+		n = prometheus_suffixes(ss->type, &suffix);
+		for (j = 0; j < n; j++) {
+			keys[nkeys].metric = ss->metric;
+			keys[nkeys].suffix = suffix[j];
+			keys[nkeys].index = nkeys;
+			nkeys++;
+		}
+	}
+	qsort(keys, nkeys, sizeof(*keys), prometheus_key_cmp);
+
+	if ((group = calloc(nkeys, sizeof(*group))) == NULL) {
+		free(keys);
+		return;
+	}
+	for (k = 0; k < nkeys; k++) {
+		if (k > 0 && prometheus_key_cmp(&keys[k - 1], &keys[k]) != 0)
+			ngroups++;
+		group[keys[k].index] = ngroups;
+	}
+	free(keys);
+	if ((claimed = calloc(ngroups + 1, sizeof(*claimed))) == NULL) {
+		free(group);
+		return;
+	}
+
+	/* The keys were made family by family in snapshot order */
+	for (i = 0, k = 0; i < snap->count; i++) {
+		ss = &snap->stats[i];
+		if (i > 0 && ss[-1].type == ss->type &&
+		    !strcmp(ss[-1].metric, ss->metric)) {
+			ss->clash = ss[-1].clash;
+			continue;
+		}
+		n = prometheus_suffixes(ss->type, &suffix);
+		for (j = 0, clash = 0; j < n; j++)
+			clash |= claimed[group[k + j]];
+		if (!clash)
+			for (j = 0; j < n; j++)
+				claimed[group[k + j]] = 1;
+		ss->clash = clash;
+		k += n;
+	}
+
+	free(claimed);
+	free(group);
+}
+
+/* Tags become labels, along with the quantile for a summary or the
+ * bucket boundary for a histogram
+ */
+void
+prometheus_labels(struct evbuffer *buf, const char *tags, const char *label,
+    const char *value)
+{
+	const char	*p;
+	int		 key = 1;
+
+	if (tags == NULL && label == NULL)
+		return;
+
+	evbuffer_add(buf, "{", 1);
+	for (p = tags; p != NULL && *p != '\0'; p++) {
+		if (*p == ',') {
+			evbuffer_add(buf, "\",", 2);
+			key = 1;
+		} else if (*p == ':' && key) {
+			evbuffer_add(buf, "=\"", 2);
+			key = 0;
+		} else if (key) {
+			/* Label names can't begin with a digit either */
+			if ((p == tags || p[-1] == ',') &&
+			    isdigit((unsigned char)*p))
+				evbuffer_add(buf, "_", 1);
+			evbuffer_add(buf, (*p == ':') ? "_" :
+			    &prometheus_charmap[(unsigned char)*p], 1);
+		}
+		else if (*p == '"' || *p == '\\') {
+			evbuffer_add(buf, "\\", 1);
+			evbuffer_add(buf, p, 1);
+		} else
+			evbuffer_add(buf, p, 1);
+	}
+	if (tags != NULL)
+		evbuffer_add(buf, "\"", 1);
+	if (label != NULL)
+		evbuffer_add_printf(buf, "%s%s=\"%s\"",
+		    (tags != NULL) ? "," : "", label, value);
+	evbuffer_add(buf, "}", 1);
+}
+
+/* Statistics with the same name but different tags follow each other,
+ * only the first of them gets the TYPE line
+ */
+void
+prometheus_stat(struct evbuffer *buf, struct snapshot_stat *ss,
+    const char *name, int first, struct timeval tv)
+{
+	char			 q[16];
+	unsigned long long	 ms, count = 0;
+	size_t			 i;
+
+	ms = (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+	switch (ss->type) {
+	case STATSD_COUNTER:
+		/* Counters are reset every interval so to Prometheus they
+		 * look more like a gauge than a monotonic counter
+		 */
+		/* FALLTHROUGH */
+	case STATSD_GAUGE:
+		if (first)
+			evbuffer_add_printf(buf, "# TYPE %s gauge\n", name);
+		evbuffer_add_printf(buf, "%s", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %Lf %llu\n", ss->value.count, ms);
+		break;
+	case STATSD_TIMER:
+		if (first)
+			evbuffer_add_printf(buf, "# TYPE %s summary\n", name);
+		for (i = 0; i < sizeof(prometheus_quantiles) /
+		    sizeof(prometheus_quantiles[0]); i++) {
+			snprintf(q, sizeof(q), "%g", prometheus_quantiles[i]);
+			evbuffer_add_printf(buf, "%s", name);
+			prometheus_labels(buf, ss->tags, "quantile", q);
+			evbuffer_add_printf(buf, " %Lf %llu\n",
+			    readings_quantile(&ss->value.timer.readings,
+			    ss->value.timer.count, prometheus_quantiles[i]),
+			    ms);
+		}
+		evbuffer_add_printf(buf, "%s_sum", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %Lf %llu\n", ss->value.timer.sum,
+		    ms);
+		evbuffer_add_printf(buf, "%s_count", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %llu %llu\n",
+		    ss->value.timer.count, ms);
+		break;
+	case STATSD_SET:
+		if (first)
+			evbuffer_add_printf(buf, "# TYPE %s gauge\n", name);
+		evbuffer_add_printf(buf, "%s", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %llu %llu\n", ss->value.set.count,
+		    ms);
+		break;
+	case STATSD_HISTOGRAM:
+		if (first)
+			evbuffer_add_printf(buf, "# TYPE %s histogram\n", name);
+		for (i = 0; i < ss->value.histogram.nbounds; i++) {
+			count += ss->value.histogram.counts[i];
+			snprintf(q, sizeof(q), "%g",
+			    ss->value.histogram.bounds[i]);
+			evbuffer_add_printf(buf, "%s_bucket", name);
+			prometheus_labels(buf, ss->tags, "le", q);
+			evbuffer_add_printf(buf, " %llu %llu\n", count, ms);
+		}
+		evbuffer_add_printf(buf, "%s_bucket", name);
+		prometheus_labels(buf, ss->tags, "le", "+Inf");
+		evbuffer_add_printf(buf, " %llu %llu\n",
+		    ss->value.histogram.count, ms);
+		evbuffer_add_printf(buf, "%s_sum", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %Lf %llu\n",
+		    ss->value.histogram.sum, ms);
+		evbuffer_add_printf(buf, "%s_count", name);
+		prometheus_labels(buf, ss->tags, NULL, NULL);
+		evbuffer_add_printf(buf, " %llu %llu\n",
+		    ss->value.histogram.count, ms);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+prometheus_reply_free(struct prometheus_reply *pr)
+{
+	evhttp_connection_set_closecb(pr->evcon, NULL, NULL);
+	snapshot_unref(pr->snap);
+	free(pr);
+}
+
+/* Send the next chunk of the snapshot, the next one is only generated once
+ * this one has been written so the output buffer stays small
+ */
+void
+prometheus_chunk(struct prometheus_reply *pr)
+{
+	struct evhttp_request	*req = pr->req;
+	struct evbuffer		*buf;
+	struct snapshot_stat	*ss;
+	size_t			 last;
+	int			 first;
+
+	if (pr->next == pr->snap->count || (buf = evbuffer_new()) == NULL) {
+		prometheus_reply_free(pr);
+		evhttp_send_reply_end(req);
+		return;
+	}
+
+	last = MIN(pr->next + STATSD_HTTP_CHUNK, pr->snap->count);
+	for (; pr->next < last; pr->next++) {
+		ss = &pr->snap->stats[pr->next];
+		first = pr->next == 0 || ss[-1].type != ss->type ||
+		    strcmp(ss[-1].metric, ss->metric);
+		if (ss->clash)
+			continue;
+		if (first)
+			prometheus_name(pr->name, sizeof(pr->name),
+			    ss->metric);
+		prometheus_stat(buf, ss, pr->name, first, pr->snap->tv);
+	}
+
+	evhttp_send_reply_chunk_with_cb(req, buf, prometheus_chunk_cb, pr);
+	evbuffer_free(buf);
+}
+
+void
+prometheus_chunk_cb(struct evhttp_connection *evcon, void *arg)
+{
+	prometheus_chunk((struct prometheus_reply *)arg);
+}
+
+void
+prometheus_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+	/* Client went away mid-stream */
+	prometheus_reply_free((struct prometheus_reply *)arg);
+}
+
+void
+process_prometheus(struct evhttp_request *req, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct prometheus_reply	*pr;
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_GET:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Content-Type", "text/plain; version=0.0.4");
+		if ((pr = calloc(1,
+		    sizeof(struct prometheus_reply))) == NULL) {
+			evhttp_send_error(req, HTTP_INTERNAL,
+			    "Internal Server Error");
+			break;
+		}
+		pr->req = req;
+		pr->evcon = evhttp_request_get_connection(req);
+		pr->snap = snapshot_get(env);
+		if (!pr->snap->clashes)
+			prometheus_clashes(pr->snap);
+		evhttp_connection_set_closecb(pr->evcon, prometheus_close_cb,
+		    pr);
+		evhttp_send_reply_start(req, HTTP_OK, "OK");
+		prometheus_chunk(pr);
+		break;
+	default:
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Allow", "GET");
+		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
+		break;
+	}
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* Samples are only ever aggregated at the finest interval. A rollup is a
+ * coarser one, a multiple of it, built up by merging in each statistic of
+ * the finest interval as it is sent: counters are summed, timer readings
+ * and set values merged, histogram buckets added up and the last gauge
+ * value kept. Once enough of the finest intervals have gone by the rollup
+ * is taken as a snapshot of its own and sent under its prefix
+ */
+int		 rollup_stat_cmp(struct rollup_stat *, struct rollup_stat *);
+void		 rollup_grow(struct statsd *, struct rollup *, size_t);
+void		 rollup_clear(struct statsd *, struct rollup *);
+void		 rollup_merge(struct statsd *, struct rollup *,
+		    struct snapshot_stat *, struct snapshot_stat *);
+
+RB_PROTOTYPE(rollup_stats, rollup_stat, entry, rollup_stat_cmp);
+
+/* Sorted by type first so a rollup is walked in snapshot order */
+int
+rollup_stat_cmp(struct rollup_stat *r1, struct rollup_stat *r2)
+{
+	int	 rv;
+
+	if (r1->ss.type != r2->ss.type)
+		return ((r1->ss.type > r2->ss.type) -
+		    (r1->ss.type < r2->ss.type));
+	if ((rv = strcmp(r1->ss.metric, r2->ss.metric)) != 0)
+		return (rv);
+	if (r1->ss.tags == NULL || r2->ss.tags == NULL)
+		return ((r1->ss.tags != NULL) - (r2->ss.tags != NULL));
+
+	return (strcmp(r1->ss.tags, r2->ss.tags));
+}
+
+void
+rollup_grow(struct statsd *env, struct rollup *r, size_t size)
+{
+	r->size += size;
+	env->rollup_memory += size;
+}
+
+/* Throw away whatever the rollup has built up so far */
+void
+rollup_clear(struct statsd *env, struct rollup *r)
+{
+	struct rollup_stat	*rs, *next;
+
+	for (rs = RB_MIN(rollup_stats, &r->stats); rs != NULL; rs = next) {
+		next = RB_NEXT(rollup_stats, &r->stats, rs);
+		RB_REMOVE(rollup_stats, &r->stats, rs);
+		snapshot_stat_free(&rs->ss);
+		free(rs);
+	}
+	env->rollup_memory -= r->size;
+	r->size = 0;
+	r->count = 0;
+}
+
+void
+rollup_free(struct statsd *env)
+{
+	struct rollup	*r;
+
+	while ((r = TAILQ_FIRST(&env->rollups)) != NULL) {
+		TAILQ_REMOVE(&env->rollups, r, entry);
+		rollup_clear(env, r);
+		free(r->prefix);
+		free(r);
+	}
+}
+
+void
+rollup_merge(struct statsd *env, struct rollup *r, struct snapshot_stat *to,
+    struct snapshot_stat *from)
+{
+	struct reading		*rd, *found;
+	struct unique		*u, *copy;
+	size_t			 i, j, n;
+
+	if (timercmp(&from->tv, &to->tv, >))
+		to->tv = from->tv;
+
+	switch (from->type) {
+	case STATSD_COUNTER:
+		to->value.count += from->value.count;
+		break;
+	case STATSD_GAUGE:
+		to->value.count = from->value.count;
+		break;
+	case STATSD_TIMER:
+		RB_FOREACH(rd, readings, &from->value.timer.readings) {
+			if ((found = RB_FIND(readings,
+			    &to->value.timer.readings, rd)) != NULL) {
+				found->count += rd->count;
+				continue;
+			}
+			if ((found = malloc(sizeof(struct reading))) == NULL) {
+				log_warn("malloc");
+				break;
+			}
+			*found = *rd;
+			RB_INSERT(readings, &to->value.timer.readings, found);
+			rollup_grow(env, r, READING_SIZE);
+		}
+		to->value.timer.count += from->value.timer.count;
+		break;
+	case STATSD_SET:
+		RB_FOREACH(u, uniques, &from->value.set.uniques) {
+			if (RB_FIND(uniques, &to->value.set.uniques,
+			    u) != NULL)
+				continue;
+			if ((copy = calloc(1,
+			    sizeof(struct unique))) == NULL ||
+			    (copy->value = strdup(u->value)) == NULL) {
+				log_warn("calloc");
+				free(copy);
+				break;
+			}
+			RB_INSERT(uniques, &to->value.set.uniques, copy);
+			rollup_grow(env, r, UNIQUE_SIZE(copy));
+		}
+		break;
+	case STATSD_HISTOGRAM:
+		n = from->value.histogram.nbounds;
+		if (to->value.histogram.bounds == NULL) {
+			if ((to->value.histogram.bounds = calloc(1,
+			    HISTOGRAM_SIZE(n))) == NULL) {
+				log_warn("calloc");
+				break;
+			}
+			memcpy(to->value.histogram.bounds,
+			    from->value.histogram.bounds, n * sizeof(double));
+			to->value.histogram.counts = (unsigned long long *)
+			    (to->value.histogram.bounds + n);
+			to->value.histogram.nbounds = n;
+			rollup_grow(env, r, HISTOGRAM_SIZE(n));
+		}
+		/* The boundaries only differ if the statistic was created
+		 * again after a reload, as with aggregates each bucket then
+		 * goes in the one holding its upper bound
+		 */
+		for (i = 0; i <= n; i++) {
+			j = (i < n) ? histogram_bucket(
+			    to->value.histogram.bounds,
+			    to->value.histogram.nbounds,
+			    from->value.histogram.bounds[i]) :
+			    to->value.histogram.nbounds;
+			to->value.histogram.counts[j] +=
+			    from->value.histogram.counts[i];
+		}
+		to->value.histogram.count += from->value.histogram.count;
+		to->value.histogram.sum += from->value.histogram.sum;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Merge a statistic of the finest interval into every rollup. The
+ * snapshot is published afterwards so everything is copied
+ */
+void
+rollup_add(struct statsd *env, struct snapshot_stat *ss)
+{
+	struct rollup		*r;
+	struct rollup_stat	*rs, find;
+
+	find.ss.type = ss->type;
+	find.ss.metric = ss->metric;
+	find.ss.tags = ss->tags;
+
+	TAILQ_FOREACH(r, &env->rollups, entry) {
+		if ((rs = RB_FIND(rollup_stats, &r->stats, &find)) == NULL) {
+			if ((rs = calloc(1,
+			    sizeof(struct rollup_stat))) == NULL ||
+			    (rs->ss.metric = strdup(ss->metric)) == NULL ||
+			    (ss->tags != NULL &&
+			    (rs->ss.tags = strdup(ss->tags)) == NULL))
+				fatal("rollup_add");
+			rs->ss.type = ss->type;
+			rs->ss.tv = ss->tv;
+			RB_INSERT(rollup_stats, &r->stats, rs);
+			r->count++;
+			rollup_grow(env, r, sizeof(struct snapshot_stat) +
+			    strlen(ss->metric) + 1 +
+			    ((ss->tags != NULL) ? strlen(ss->tags) + 1 : 0));
+		}
+		rollup_merge(env, r, &rs->ss, ss);
+	}
+}
+
+/* Another of the finest intervals has been sent */
+void
+rollup_tick(struct statsd *env)
+{
+	struct rollup	*r;
+
+	TAILQ_FOREACH(r, &env->rollups, entry)
+		if (++r->ticks >= r->every) {
+			r->ticks = 0;
+			r->due = 1;
+		}
+}
+
+/* Take the next rollup whose window has ended as a snapshot ready to be
+ * sent, leaving it empty for the next window. The statistics are moved
+ * across in order, so the snapshot is grouped by type the same as one of
+ * the finest interval
+ */
+struct snapshot *
+rollup_snapshot(struct statsd *env, struct timeval tv)
+{
+	struct rollup		*r;
+	struct rollup_stat	*rs, *next;
+	struct snapshot		*snap;
+	int			 i;
+
+	TAILQ_FOREACH(r, &env->rollups, entry) {
+		if (!r->due)
+			continue;
+		r->due = 0;
+
+		if ((snap = calloc(1, sizeof(struct snapshot))) == NULL ||
+		    (r->count > 0 && (snap->stats = calloc(r->count,
+		    sizeof(struct snapshot_stat))) == NULL) ||
+		    (snap->prefix = strdup(r->prefix)) == NULL) {
+			log_warn("rollup_snapshot");
+			if (snap != NULL) {
+				free(snap->stats);
+				free(snap);
+			}
+			rollup_clear(env, r);
+			continue;
+		}
+		snap->refcnt = 1;
+		snap->tv = tv;
+		snap->size = sizeof(struct snapshot) + r->size;
+
+		i = 0;
+		for (rs = RB_MIN(rollup_stats, &r->stats); rs != NULL;
+		    rs = next) {
+			next = RB_NEXT(rollup_stats, &r->stats, rs);
+			RB_REMOVE(rollup_stats, &r->stats, rs);
+			while (i <= (int)rs->ss.type)
+				snap->first[i++] = snap->count;
+			snap->stats[snap->count++] = rs->ss;
+			free(rs);
+		}
+		while (i <= STATSD_MAX_TYPE)
+			snap->first[i++] = snap->count;
+
+		env->rollup_memory -= r->size;
+		r->size = 0;
+		r->count = 0;
+
+		return (snap);
+	}
+
+	return (NULL);
+}
+
+/* Rollups still configured carry on with the window they are part way
+ * through, unless the finest interval they are counted in has changed
+ */
+void
+rollup_reload(struct statsd *env, struct statsd *nenv)
+{
+	struct rollup	*r, *nr;
+
+	if (timercmp(&env->graphite_interval, &nenv->graphite_interval, ==))
+		TAILQ_FOREACH(nr, &nenv->rollups, entry) {
+			TAILQ_FOREACH(r, &env->rollups, entry)
+				if (timercmp(&r->interval, &nr->interval, ==))
+					break;
+			if (r == NULL)
+				continue;
+			nr->stats = r->stats;
+			RB_INIT(&r->stats);
+			nr->count = r->count;
+			nr->size = r->size;
+			nr->ticks = r->ticks;
+			nr->due = r->due;
+			r->count = r->size = 0;
+		}
+
+	rollup_free(env);
+	TAILQ_CONCAT(&env->rollups, &nenv->rollups, entry);
+}
+
+RB_GENERATE(rollup_stats, rollup_stat, entry, rollup_stat_cmp);
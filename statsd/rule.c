@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* Every drop and rewrite pattern is compiled into one trie, one node per
+ * character. A '*' matches one or more characters up to the next '.', as
+ * in a Graphite path, and a '**' one or more of anything. What each of
+ * them matched can be put back into a rewritten name as $1 to $9. Where
+ * more than one rule matches, the first in the configuration wins.
+ *
+ * A name is matched against every pattern at once, a character at a time,
+ * keeping the set of nodes it has reached so far. Each node is only in the
+ * set once, with the captures of the first way there that ends each
+ * wildcard as early as possible, so nothing is ever tried twice and the
+ * work is at most the length of the name times the size of the trie. A
+ * name that has left the trie altogether stops there.
+ *
+ * Names a drop or rewrite rule matched are remembered along with what
+ * they are rewritten to. They never become a statistic under their own
+ * name so would otherwise be matched again on every packet
+ */
+enum rule_wild {
+	RULE_LITERAL = 0,
+	RULE_STAR,		/* within a component */
+	RULE_STARSTAR		/* across components */
+};
+
+struct rule_node {
+	struct rule_node	*child;
+	struct rule_node	*next;
+	struct rule		*rule;
+	unsigned long long	 gen;	/* last step it was reached on */
+	enum rule_wild		 wild;
+	unsigned char		 c;
+};
+
+struct rule_capture {
+	const char	*p;
+	size_t		 len;
+};
+
+/* One node reached so far and how the name got there */
+struct rule_thread {
+	struct rule_node	*node;
+	struct rule_capture	 caps[RULE_MAX_CAPTURES];
+	int			 ncaps;
+};
+
+void		 rule_node_free(struct rule_node *);
+void		 rule_insert(struct statsd *, struct rule_node **,
+		    struct rule *);
+void		 rule_cache_clear(struct statsd *);
+uint32_t	 rule_hash(const char *);
+void		 rule_reach(struct statsd *, struct rule_thread *, size_t *,
+		    struct rule_node *, struct rule_thread *, const char *);
+void		 rule_follow(struct statsd *, struct rule_thread *, size_t *,
+		    struct rule_node *, struct rule_thread *, const char *);
+int		 rule_expand(struct rule *, struct rule_capture *, char *,
+		    size_t);
+
+void
+rule_node_free(struct rule_node *node)
+{
+	struct rule_node	*next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		rule_node_free(node->child);
+		free(node);
+	}
+}
+
+void
+rule_cache_clear(struct statsd *env)
+{
+	int	 i;
+
+	for (i = 0; i < RULE_CACHE_SIZE; i++) {
+		free(env->rule_cache[i].metric);
+		free(env->rule_cache[i].name);
+		env->rule_cache[i].metric = env->rule_cache[i].name = NULL;
+	}
+}
+
+void
+rule_free(struct statsd *env)
+{
+	struct rule	*r;
+
+	rule_cache_clear(env);
+	rule_node_free(env->rule_root);
+	rule_node_free(env->aggregate_root);
+	env->rule_root = env->aggregate_root = NULL;
+	free(env->rule_threads);
+	env->rule_threads = NULL;
+	env->rule_nodes = 0;
+
+	while ((r = TAILQ_FIRST(&env->rules)) != NULL) {
+		TAILQ_REMOVE(&env->rules, r, entry);
+		free(r->pattern);
+		free(r->replace);
+		free(r);
+	}
+}
+
+void
+rule_insert(struct statsd *env, struct rule_node **np, struct rule *r)
+{
+	struct rule_node	*node = NULL;
+	const unsigned char	*p;
+	enum rule_wild		 wild;
+
+	for (p = (unsigned char *)r->pattern; *p != '\0'; p++) {
+		if (p[0] != '*')
+			wild = RULE_LITERAL;
+		else if (p[1] != '*')
+			wild = RULE_STAR;
+		else {
+			wild = RULE_STARSTAR;
+			p++;
+		}
+		for (; *np != NULL; np = &(*np)->next)
+			if ((*np)->wild == wild &&
+			    (wild != RULE_LITERAL || (*np)->c == *p))
+				break;
+		if (*np == NULL) {
+			if ((*np = calloc(1, sizeof(struct rule_node))) == NULL)
+				fatal("calloc");
+			(*np)->wild = wild;
+			(*np)->c = *p;
+			env->rule_nodes++;
+		}
+		node = *np;
+		np = &node->child;
+	}
+	if (node == NULL)
+		return;
+	if (node->rule != NULL) {
+		log_warnx("duplicate rule for \"%s\"", r->pattern);
+		return;
+	}
+	node->rule = r;
+}
+
+/* Build a trie for the drop and rewrite rules and another for the
+ * aggregates, then delete any statistic a drop rule now matches
+ */
+void
+rule_index(struct statsd *env)
+{
+	struct rule		*r;
+	struct statistic	*stat, *next;
+	char			 name[STATSD_MAX_UDP_PACKET];
+	unsigned int		 index = 0;
+
+	rule_cache_clear(env);
+	rule_node_free(env->rule_root);
+	rule_node_free(env->aggregate_root);
+	env->rule_root = env->aggregate_root = NULL;
+	free(env->rule_threads);
+	env->rule_threads = NULL;
+	env->rule_nodes = 0;
+
+	TAILQ_FOREACH(r, &env->rules, entry) {
+		r->index = index++;
+		rule_insert(env, (r->action == RULE_AGGREGATE) ?
+		    &env->aggregate_root : &env->rule_root, r);
+	}
+
+	if (env->rule_nodes == 0)
+		return;
+
+	/* Room for the nodes reached so far and those reached next */
+	if ((env->rule_threads = calloc(2 * env->rule_nodes,
+	    sizeof(struct rule_thread))) == NULL)
+		fatal("calloc");
+
+	if (env->rule_root == NULL)
+		return;
+
+	for (stat = RB_MIN(statistics, &env->stats); stat != NULL;
+	    stat = next) {
+		next = RB_NEXT(statistics, &env->stats, stat);
+		if ((r = rule_find(env, env->rule_root, stat->metric, name,
+		    sizeof(name))) != NULL && r->action == RULE_DROP)
+			statistic_delete(env, stat);
+	}
+}
+
+uint32_t
+rule_hash(const char *p)
+{
+	uint32_t	 h = 2166136261U;
+
+	/* FNV-1a */
+	while (*p != '\0') {
+		h ^= (unsigned char)*p++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+/* Reach a node having matched the character at p, unless it was already
+ * reached a better way. A wildcard node reached from its parent starts a
+ * capture and one reached from itself makes its capture longer
+ */
+void
+rule_reach(struct statsd *env, struct rule_thread *set, size_t *n,
+    struct rule_node *node, struct rule_thread *from, const char *p)
+{
+	struct rule_thread	*t;
+
+	if (node->gen == env->rule_gen)
+		return;
+	node->gen = env->rule_gen;
+
+	t = &set[(*n)++];
+	if (from != NULL) {
+		memcpy(t->caps, from->caps, sizeof(t->caps));
+		t->ncaps = from->ncaps;
+	} else {
+		bzero(t->caps, sizeof(t->caps));
+		t->ncaps = 0;
+	}
+	t->node = node;
+
+	if (node->wild == RULE_LITERAL)
+		return;
+	if (from != NULL && from->node == node) {
+		if (t->ncaps <= RULE_MAX_CAPTURES)
+			t->caps[t->ncaps - 1].len++;
+		return;
+	}
+	if (t->ncaps < RULE_MAX_CAPTURES) {
+		t->caps[t->ncaps].p = p;
+		t->caps[t->ncaps].len = 1;
+	}
+	t->ncaps++;
+}
+
+/* Try the character at p against each of a list of sibling nodes */
+void
+rule_follow(struct statsd *env, struct rule_thread *set, size_t *n,
+    struct rule_node *node, struct rule_thread *from, const char *p)
+{
+	for (; node != NULL; node = node->next)
+		if ((node->wild == RULE_LITERAL) ?
+		    node->c == (unsigned char)*p :
+		    (*p != '.' || node->wild == RULE_STARSTAR))
+			rule_reach(env, set, n, node, from, p);
+}
+
+/* Build the rewritten name, the captures have been checked against the
+ * pattern already
+ */
+int
+rule_expand(struct rule *r, struct rule_capture *caps, char *buf, size_t len)
+{
+	const char	*p;
+	size_t		 i = 0, n;
+
+	for (p = r->replace; *p != '\0'; p++) {
+		if (*p == '$' && p[1] >= '1' && p[1] <= '9') {
+			n = *++p - '1';
+			if (i + caps[n].len >= len)
+				return (-1);
+			memcpy(buf + i, caps[n].p, caps[n].len);
+			i += caps[n].len;
+		} else {
+			if (i + 1 >= len)
+				return (-1);
+			buf[i++] = *p;
+		}
+	}
+	buf[i] = '\0';
+
+	return (0);
+}
+
+/* The rule for a name, if there is one, with the new name written to buf
+ * if it is rewritten or aggregated. A name that doesn't fit is treated as
+ * no match
+ */
+struct rule *
+rule_find(struct statsd *env, struct rule_node *root, const char *metric,
+    char *buf, size_t len)
+{
+	struct rule_thread	*cur, *next, *t, *best = NULL;
+	const char		*p;
+	size_t			 ncur = 0, nnext, i;
+
+	if (root == NULL || *metric == '\0')
+		return (NULL);
+
+	cur = env->rule_threads;
+	next = cur + env->rule_nodes;
+
+	for (p = metric; *p != '\0'; p++) {
+		env->rule_gen++;
+		nnext = 0;
+		if (p == metric)
+			rule_follow(env, next, &nnext, root, NULL, p);
+		/* In order, so the first way to reach a node keeps it. A
+		 * wildcard tries ending before going on
+		 */
+		for (i = 0; i < ncur; i++) {
+			t = &cur[i];
+			rule_follow(env, next, &nnext, t->node->child, t, p);
+			if (t->node->wild == RULE_STARSTAR ||
+			    (t->node->wild == RULE_STAR && *p != '.'))
+				rule_reach(env, next, &nnext, t->node, t, p);
+		}
+		if (nnext == 0)
+			return (NULL);
+
+		t = cur;
+		cur = next;
+		next = t;
+		ncur = nnext;
+	}
+
+	for (i = 0; i < ncur; i++)
+		if (cur[i].node->rule != NULL && (best == NULL ||
+		    cur[i].node->rule->index < best->node->rule->index))
+			best = &cur[i];
+	if (best == NULL)
+		return (NULL);
+
+	if (best->node->rule->replace != NULL &&
+	    rule_expand(best->node->rule, best->caps, buf, len) == -1)
+		return (NULL);
+
+	return (best->node->rule);
+}
+
+/* As rule_find() for the drop and rewrite rules */
+struct rule *
+rule_lookup(struct statsd *env, const char *metric, char *buf, size_t len)
+{
+	struct rule_cache	*rc;
+	struct rule		*r;
+	uint32_t		 h;
+	size_t			 n;
+
+	h = rule_hash(metric);
+	rc = &env->rule_cache[h & (RULE_CACHE_SIZE - 1)];
+	if (rc->metric != NULL && rc->hash == h &&
+	    !strcmp(rc->metric, metric)) {
+		if (rc->name != NULL) {
+			if ((n = strlen(rc->name)) >= len)
+				return (NULL);
+			memcpy(buf, rc->name, n + 1);
+		}
+		return (rc->rule);
+	}
+
+	if ((r = rule_find(env, env->rule_root, metric, buf, len)) == NULL)
+		return (NULL);
+
+	free(rc->metric);
+	free(rc->name);
+	rc->name = NULL;
+	if ((rc->metric = strdup(metric)) == NULL ||
+	    (r->action == RULE_REWRITE &&
+	    (rc->name = strdup(buf)) == NULL)) {
+		free(rc->metric);
+		rc->metric = NULL;
+		return (r);
+	}
+	rc->hash = h;
+	rc->rule = r;
+
+	return (r);
+}
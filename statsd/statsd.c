@@ -25,99 +25,53 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <err.h>
+#include <stdint.h>
 #include <signal.h>
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/http.h>
+#include <event2/thread.h>
 
 #include "statsd.h"
 
-struct statistic_dispatch {
-	char	 *path;
-	void	(*single_cb)(struct evhttp_request *, void *);
-	void	(*list_cb)(struct evhttp_request *, void *);
-};
-
 __dead void	 usage(void);
-int		 statistic_cmp(struct statistic *, struct statistic *);
-int		 reading_cmp(struct reading *, struct reading *);
-int		 unique_cmp(struct unique *, struct unique *);
 void		 stats_timer_cb(int, short, void *);
+void		 stats_hist(struct statsd *, const char *, struct hist *,
+		    struct timeval);
 void		 stats_connect_cb(struct graphite_connection *, void *);
 void		 stats_disconnect_cb(struct graphite_connection *, void *);
 void		 graphite_connect_cb(struct graphite_connection *, void *);
 void		 graphite_disconnect_cb(struct graphite_connection *, void *);
-void		 graphite_timer_cb(int, short, void *);
-void		 process_generic_list(struct evhttp_request *, void *,
-		    enum statistic_type);
-void		 process_counter_list(struct evhttp_request *, void *);
-void		 process_timer_list(struct evhttp_request *, void *);
-void		 process_gauge_list(struct evhttp_request *, void *);
-void		 process_set_list(struct evhttp_request *, void *);
-void		 process_generic(struct evhttp_request *, void *,
-		    enum statistic_type);
-void		 process_counter(struct evhttp_request *, void *);
-void		 process_timer(struct evhttp_request *, void *);
-void		 process_gauge(struct evhttp_request *, void *);
-void		 process_set(struct evhttp_request *, void *);
+char		*graphite_tagged(char *, size_t, char *, const char *);
+void		 graphite_le(char *, size_t, double);
+void		 graphite_flush_stat(struct statsd *, struct snapshot_stat *,
+		    struct timeval, const char *);
+void		 graphite_flush_done(struct statsd *, struct snapshot *);
+void		 graphite_flush_cb(int, short, void *);
+void		 statsd_command_cb(int, short, void *);
 void		 statsd_read_cb(int, short, void *);
+int		 listen_addr_open(struct statsd *, struct listen_addr *);
+void		 statsd_reload(struct statsd *);
 void		 handle_signal(int, short, void *);
 
-RB_PROTOTYPE(statistics, statistic, entry, statistic_cmp);
-RB_GENERATE(statistics, statistic, entry, statistic_cmp);
-
-RB_PROTOTYPE(readings, reading, entry, reading_cmp);
-RB_GENERATE(readings, reading, entry, reading_cmp);
-
-RB_PROTOTYPE(uniques, unique, entry, unique_cmp);
-RB_GENERATE(uniques, unique, entry, unique_cmp);
-
-struct statistic_dispatch dispatch[STATSD_MAX_TYPE] = {
-	{ "counters", process_counter, process_counter_list },
-	{ "timers",   process_timer,   process_timer_list   },
-	{ "gauges",   process_gauge,   process_gauge_list   },
-	{ "sets",     process_set,     process_set_list     }
-};
-
 __dead void
 usage(void)
 {
 	extern char	*__progname;
 
-	fprintf(stderr, "usage: %s [-dnv] [-f file]\n", __progname);
+	fprintf(stderr, "usage: %s [-dnpuv] [-f file] [-r file] [-w file]\n",
+	    __progname);
 	exit(1);
 }
 
-int
-statistic_cmp(struct statistic *s1, struct statistic *s2)
-{
-	return (strcmp(s1->metric, s2->metric));
-}
-
-int
-reading_cmp(struct reading *r1, struct reading *r2)
-{
-	if (r1->value > r2->value)
-		return (1);
-	else if (r1->value < r2->value)
-		return (-1);
-	else
-		return (0);
-}
-
-int
-unique_cmp(struct unique *u1, struct unique *u2)
-{
-	return (strcmp(u1->value, u2->value));
-}
-
 void
 stats_timer_cb(int fd, short event, void *arg)
 {
 	struct statsd	*env = (struct statsd *)arg;
 	struct timeval	 tv;
+	char		 metric[BUFSIZ];
 	int		 i;
 
 	gettimeofday(&tv, NULL);
@@ -141,11 +95,76 @@ stats_timer_cb(int fd, short event, void *arg)
 	graphite_send_metric(env->stats_conn, env->stats_prefix,
 	    "metrics.rx", tv, "%lld", env->metrics_rx);
 	graphite_send_metric(env->stats_conn, env->stats_prefix,
-	    "search.mus", tv, "%lld",
-	    (env->seek_tv.tv_sec * 1000000) + env->seek_tv.tv_usec);
+	    "search.mus", tv, "%llu", env->seek_ns / 1000);
 	for (i = 0; i < STATSD_MAX_TYPE; i++)
 		graphite_send_metric(env->stats_conn, env->stats_prefix,
 		    dispatch[i].path, tv, "%lld", env->count[i]);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "flush.duration.mus", tv, "%lld",
+	    ((long long)env->flush_tv.tv_sec * 1000000) +
+	    env->flush_tv.tv_usec);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "flush.slice.max.mus", tv, "%lld",
+	    ((long long)env->flush_slice_tv.tv_sec * 1000000) +
+	    env->flush_slice_tv.tv_usec);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "memory.statistics", tv, "%zu", env->memory);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "memory.total", tv, "%zu", statsd_memory(env));
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "memory.refused", tv, "%llu", env->memory_refused);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "log.suppressed", tv, "%llu", env->log_limit.total);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "log.dropped", tv, "%llu", log_dropped);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "limit.dropped", tv, "%llu", env->limit_dropped);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "limit.overflowed", tv, "%llu", env->limit_overflowed);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "rule.dropped", tv, "%llu", env->rule_dropped);
+	graphite_send_metric(env->stats_conn, env->stats_prefix,
+	    "rule.rewritten", tv, "%llu", env->rule_rewritten);
+	for (i = 0; i < BAD_MAX; i++) {
+		snprintf(metric, sizeof(metric), "bad.%s", bad_names[i]);
+		graphite_send_metric(env->stats_conn, env->stats_prefix,
+		    metric, tv, "%llu", env->bad[i]);
+	}
+	if (env->checkpoint_path != NULL)
+		graphite_send_metric(env->stats_conn, env->stats_prefix,
+		    "checkpoint.mus", tv, "%lld",
+		    ((long long)env->checkpoint_tv.tv_sec * 1000000) +
+		    env->checkpoint_tv.tv_usec);
+
+	/* Histograms and the longest slice are reported per interval */
+	for (i = 0; i < HIST_MAX; i++) {
+		stats_hist(env, hist_names[i], &env->hist[i], tv);
+		hist_reset(&env->hist[i]);
+	}
+	timerclear(&env->flush_slice_tv);
+}
+
+void
+stats_hist(struct statsd *env, const char *name, struct hist *h,
+    struct timeval tv)
+{
+	char	 metric[BUFSIZ];
+
+	snprintf(metric, sizeof(metric), "%s.count", name);
+	graphite_send_metric(env->stats_conn, env->stats_prefix, metric, tv,
+	    "%llu", h->count);
+	snprintf(metric, sizeof(metric), "%s.p50", name);
+	graphite_send_metric(env->stats_conn, env->stats_prefix, metric, tv,
+	    "%llu", (unsigned long long)hist_quantile(h, 0.5));
+	snprintf(metric, sizeof(metric), "%s.p90", name);
+	graphite_send_metric(env->stats_conn, env->stats_prefix, metric, tv,
+	    "%llu", (unsigned long long)hist_quantile(h, 0.9));
+	snprintf(metric, sizeof(metric), "%s.p99", name);
+	graphite_send_metric(env->stats_conn, env->stats_prefix, metric, tv,
+	    "%llu", (unsigned long long)hist_quantile(h, 0.99));
+	snprintf(metric, sizeof(metric), "%s.max", name);
+	graphite_send_metric(env->stats_conn, env->stats_prefix, metric, tv,
+	    "%llu", (unsigned long long)h->max);
 }
 
 void
@@ -177,6 +196,7 @@ graphite_connect_cb(struct graphite_connection *c, void *arg)
 	log_debug("Connected to %s:%hu", env->graphite_host,
 	    env->graphite_port);
 	env->state |= STATSD_GRAPHITE_CONNECTED;
+	replay_start(env);
 }
 
 void
@@ -189,564 +209,613 @@ graphite_disconnect_cb(struct graphite_connection *c, void *arg)
 	env->state &= ~(STATSD_GRAPHITE_CONNECTED);
 }
 
+/* Make the snapshot the one served over HTTP, taking over the reference
+ * passed in
+ */
 void
-graphite_timer_cb(int fd, short event, void *arg)
+snapshot_publish(struct statsd *env, struct snapshot *snap)
 {
-	struct statsd		*env = (struct statsd *)arg;
-	struct statistic	*stat;
-	struct timeval		 tv;
-	struct reading		*r1, *r2;
-	struct unique		*u1, *u2;
-	unsigned long long	 count;
-	long double		 sum, min, max, mean;
+	struct snapshot	*old;
 
-	gettimeofday(&tv, NULL);
+	pthread_mutex_lock(&env->snap_mtx);
+	old = env->published;
+	env->published = snap;
+	pthread_mutex_unlock(&env->snap_mtx);
 
-	for (stat = RB_MIN(statistics, &env->stats); stat;
-	    stat = RB_NEXT(statistics, &env->stats, stat)) {
-		switch (stat->type) {
-		case STATSD_COUNTER:
-			/* FALLTHROUGH */
-		case STATSD_GAUGE:
-			log_debug("Sending %s = %Lf to graphite", stat->metric,
-			    stat->value.count);
-			if (env->state & STATSD_GRAPHITE_CONNECTED) {
-				graphite_send_metric(env->graphite_conn,
-				    NULL, stat->metric, tv, "%Lf",
-				    stat->value.count);
-			}
-			if (stat->type == STATSD_COUNTER)
-				stat->value.count = 0;
-			break;
-		case STATSD_TIMER:
-			count = sum = min = max = mean = 0;
-			if (!RB_EMPTY(&stat->value.timer.readings)) {
-				count = stat->value.timer.count;
-				r1 = RB_MIN(readings,
-				    &stat->value.timer.readings);
-				min = max = r1->value;
-				while (r1 != NULL) {
-					sum += r1->value * r1->count;
-					max = MAX(max, r1->value);
-					r2 = RB_NEXT(readings,
-					    &stat->value.timer.readings, r1);
-					RB_REMOVE(readings,
-					    &stat->value.timer.readings, r1);
-					free(r1);
-					r1 = r2;
-				}
-				mean = sum / count;
-			}
-#if 0
-			/* Necessary? */
-			RB_INIT(&stat->value.readings);
-#endif
-			stat->value.timer.count = 0;
-			log_debug("Sending %s.count = %lld to graphite",
-			    stat->metric, count);
-			log_debug("Sending %s.sum = %Lf to graphite",
-			    stat->metric, sum);
-			log_debug("Sending %s.upper = %Lf to graphite",
-			    stat->metric, max);
-			log_debug("Sending %s.lower = %Lf to graphite",
-			    stat->metric, min);
-			log_debug("Sending %s.mean = %Lf to graphite",
-			    stat->metric, mean);
-			if (env->state & STATSD_GRAPHITE_CONNECTED) {
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "count", tv, "%lld", count);
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "sum", tv, "%Lf", sum);
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "upper", tv, "%Lf", max);
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "lower", tv, "%Lf", min);
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "mean", tv, "%Lf", mean);
-			}
-			break;
-		case STATSD_SET:
-			count = 0;
-			u1 = RB_MIN(uniques, &stat->value.uniques);
-			while (u1 != NULL) {
-				count++;
-				u2 = RB_NEXT(uniques, &stat->value.uniques, u1);
-				RB_REMOVE(uniques, &stat->value.uniques, u1);
-				free(u1->value);
-				free(u1);
-				u1 = u2;
-			}
-#if 0
-			/* Necessary? */
-			RB_INIT(&stat->value.uniques);
-#endif
-			log_debug("Sending %s.count = %lld to graphite",
-			    stat->metric, count);
-			if (env->state & STATSD_GRAPHITE_CONNECTED) {
-				graphite_send_metric(env->graphite_conn,
-				    stat->metric, "count", tv, "%lld", count);
-			}
-			break;
-		default:
-			break;
-		}
-	}
+	if (old != NULL)
+		snapshot_unref(old);
 }
 
-void
-process_generic_list(struct evhttp_request *req, void *arg,
-    enum statistic_type type)
+struct snapshot *
+snapshot_get(struct statsd *env)
 {
-	struct statsd		*env = (struct statsd *)arg;
-	struct evbuffer		*buf;
-	struct statistic	*stat;
+	struct snapshot	*snap;
 
-	switch (evhttp_request_get_command(req)) {
-	case EVHTTP_REQ_GET:
-		if ((buf = evbuffer_new()) == NULL)
-			return;
-		evbuffer_add_printf(buf, "[");
-		for (stat = RB_MIN(statistics, &env->stats); stat;
-		    stat = RB_NEXT(statistics, &env->stats, stat)) {
-			/* Not the type we're interested in, next! */
-			if (stat->type != type)
-				continue;
-			evbuffer_add_printf(buf, "\"%s\"", stat->metric);
-			if (RB_NEXT(statistics, &env->stats, stat))
-				evbuffer_add_printf(buf, ",");
-		}
-		evbuffer_add_printf(buf, "]\n");
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-		    "Content-Type", "application/json");
-		evhttp_send_reply(req, HTTP_OK, "OK", buf);
-		evbuffer_free(buf);
-		break;
-	default:
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-		    "Allow", "GET");
-#if 0
-		/* evhttp_send_error() doesn't appear to honour any
-		 * additional headers set, unlike evhttp_send_reply(). RFC
-		 * states we should send back Allow: header.
-		 */
-		evhttp_send_error(req, HTTP_BADMETHOD, "Bad Method");
-#else
-		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
-#endif
-		break;
-	}
-}
+	pthread_mutex_lock(&env->snap_mtx);
+	snap = snapshot_ref(env->published);
+	pthread_mutex_unlock(&env->snap_mtx);
 
-void
-process_counter_list(struct evhttp_request *req, void *arg)
-{
-	process_generic_list(req, arg, STATSD_COUNTER);
+	return (snap);
 }
 
-void
-process_timer_list(struct evhttp_request *req, void *arg)
+/* Append Graphite 1.1 tags to the last component of a path */
+char *
+graphite_tagged(char *buf, size_t len, char *name, const char *tags)
 {
-	process_generic_list(req, arg, STATSD_TIMER);
+	if (*tags == '\0')
+		return (name);
+	snprintf(buf, len, "%s%s", name, tags);
+	return (buf);
 }
 
+/* Histogram bucket names, "bucket.le_2_5" for a boundary of 2.5 */
 void
-process_gauge_list(struct evhttp_request *req, void *arg)
+graphite_le(char *buf, size_t len, double bound)
 {
-	process_generic_list(req, arg, STATSD_GAUGE);
-}
+	char	*p;
 
-void
-process_set_list(struct evhttp_request *req, void *arg)
-{
-	process_generic_list(req, arg, STATSD_SET);
+	snprintf(buf, len, "bucket.le_%g", bound);
+	for (p = buf + strlen("bucket."); *p != '\0'; p++)
+		if (*p == '.')
+			*p = '_';
 }
 
+/* Summarise the statistic and send it to graphite, under a rollup's
+ * prefix if it has one
+ */
 void
-process_generic(struct evhttp_request *req, void *arg,
-    enum statistic_type type)
+graphite_flush_stat(struct statsd *env, struct snapshot_stat *ss,
+    struct timeval tv, const char *prefix)
 {
-	struct statsd		*env = (struct statsd *)arg;
-	const char		*metric;
-	struct statistic	*stat;
-	struct evbuffer		*buf;
-	struct statistic	 find;
-	struct reading		*r1, *r2;
-	struct unique		*u1, *u2;
-	int			 i;
-
-	/* Metric is the rest of the URL after "/<type>/" */
-	metric = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)) +
-	    strlen(dispatch[type].path) + 2;
-
-	find.metric = (char *)metric;
-	stat = RB_FIND(statistics, &env->stats, &find);
-
-	/* Shouldn't ever happen */
-	if (!stat)
-		return;
+	char			 path[BUFSIZ], tags[BUFSIZ], name[BUFSIZ];
+	char			 le[64];
+	char			*metric = ss->metric;
+	unsigned long long	 count = 0;
+	size_t			 i;
+
+	snapshot_summarise(ss);
+
+	/* Tags either follow the whole path or become part of it */
+	tags[0] = '\0';
+	if (ss->tags != NULL)
+		tags_format(ss->tags, env->graphite_tags, tags, sizeof(tags));
+	if (prefix != NULL ||
+	    (tags[0] != '\0' && env->graphite_tags == TAGS_PATH)) {
+		snprintf(path, sizeof(path), "%s%s%s",
+		    (prefix != NULL) ? prefix : "", ss->metric,
+		    (env->graphite_tags == TAGS_PATH) ? tags : "");
+		metric = path;
+		if (env->graphite_tags == TAGS_PATH)
+			tags[0] = '\0';
+	}
 
-	switch (evhttp_request_get_command(req)) {
-	case EVHTTP_REQ_GET:
-		if ((buf = evbuffer_new()) == NULL)
-			return;
-		switch (type) {
-		case STATSD_COUNTER:
-			/* FALLTHROUGH */
-		case STATSD_GAUGE:
-			evbuffer_add_printf(buf,
-			    "{\"name\":\"%s\",\"value\":%Lf,\"last_modified\":%lu}\n",
-			    metric, stat->value.count, stat->tv.tv_sec);
-			break;
-		case STATSD_TIMER:
-			evbuffer_add_printf(buf,
-			    "{\"name\":\"%s\",\"last_modified\":%lu,\"values\":[",
-			    metric, stat->tv.tv_sec);
-			for (r1 = RB_MIN(readings, &stat->value.timer.readings); r1;
-			    r1 = RB_NEXT(readings, &stat->value.timer.readings, r1)) {
-				for (i = 1; i <= r1->count; i++) {
-					evbuffer_add_printf(buf, "%Lf",
-					    r1->value);
-					if (i < r1->count)
-						evbuffer_add_printf(buf, ",");
-				}
-				if (RB_NEXT(readings, &stat->value.timer.readings, r1))
-					evbuffer_add_printf(buf, ",");
-			}
-			evbuffer_add_printf(buf, "]}\n");
-			break;
-		case STATSD_SET:
-			evbuffer_add_printf(buf,
-			    "{\"name\":\"%s\",\"last_modified\":%lu,\"values\":[",
-			    metric, stat->tv.tv_sec);
-			for (u1 = RB_MIN(uniques, &stat->value.uniques); u1;
-			    u1 = RB_NEXT(uniques, &stat->value.uniques, u1)) {
-				evbuffer_add_printf(buf, "\"%s\"", u1->value);
-				if (RB_NEXT(uniques, &stat->value.uniques, u1))
-					evbuffer_add_printf(buf, ",");
-			}
-			evbuffer_add_printf(buf, "]}\n");
-			break;
-		default:
-			/* Shouldn't ever happen, return empty JSON object */
-			evbuffer_add_printf(buf, "{}\n");
-			break;
+	switch (ss->type) {
+	case STATSD_COUNTER:
+		/* FALLTHROUGH */
+	case STATSD_GAUGE:
+		if (env->verbose)
+			log_debug("Sending %s%s = %Lf to graphite", metric,
+			    tags, ss->value.count);
+		if (env->state & STATSD_GRAPHITE_CONNECTED) {
+			graphite_send_metric(env->graphite_conn, NULL,
+			    graphite_tagged(name, sizeof(name), metric, tags),
+			    tv, "%Lf", ss->value.count);
 		}
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-		    "Content-Type", "application/json");
-		evhttp_send_reply(req, HTTP_OK, "OK", buf);
-		evbuffer_free(buf);
 		break;
-	case EVHTTP_REQ_DELETE:
-		evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
-		evhttp_del_cb(env->httpd, evhttp_request_get_uri(req));
-
-		env->count[type]--;
-
-		RB_REMOVE(statistics, &env->stats, stat);
-
-		/* Some statistic types require additional cleanup */
-		switch (type) {
-		case STATSD_TIMER:
-			r1 = RB_MIN(readings, &stat->value.timer.readings);
-			while (r1 != NULL) {
-				r2 = RB_NEXT(readings,
-				    &stat->value.timer.readings, r1);
-				RB_REMOVE(readings,
-				    &stat->value.timer.readings, r1);
-				free(r1);
-				r1 = r2;
-			}
-			break;
-		case STATSD_SET:
-			u1 = RB_MIN(uniques, &stat->value.uniques);
-			while (u1 != NULL) {
-				u2 = RB_NEXT(uniques, &stat->value.uniques,
-				    u1);
-				RB_REMOVE(uniques, &stat->value.uniques, u1);
-				free(u1->value);
-				free(u1);
-				u1 = u2;
-			}
-			break;
-		default:
+	case STATSD_TIMER:
+		if (env->verbose) {
+			log_debug("Sending %s.count%s = %lld to graphite",
+			    metric, tags, ss->value.timer.count);
+			log_debug("Sending %s.sum%s = %Lf to graphite",
+			    metric, tags, ss->value.timer.sum);
+			log_debug("Sending %s.upper%s = %Lf to graphite",
+			    metric, tags, ss->value.timer.upper);
+			log_debug("Sending %s.lower%s = %Lf to graphite",
+			    metric, tags, ss->value.timer.lower);
+			log_debug("Sending %s.mean%s = %Lf to graphite",
+			    metric, tags, ss->value.timer.mean);
+		}
+		if (env->state & STATSD_GRAPHITE_CONNECTED) {
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "count", tags),
+			    tv, "%lld", ss->value.timer.count);
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "sum", tags),
+			    tv, "%Lf", ss->value.timer.sum);
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "upper", tags),
+			    tv, "%Lf", ss->value.timer.upper);
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "lower", tags),
+			    tv, "%Lf", ss->value.timer.lower);
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "mean", tags),
+			    tv, "%Lf", ss->value.timer.mean);
+		}
+		break;
+	case STATSD_SET:
+		if (env->verbose)
+			log_debug("Sending %s.count%s = %lld to graphite",
+			    metric, tags, ss->value.set.count);
+		if (env->state & STATSD_GRAPHITE_CONNECTED) {
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), "count", tags),
+			    tv, "%lld", ss->value.set.count);
+		}
+		break;
+	case STATSD_HISTOGRAM:
+		if (env->verbose)
+			log_debug("Sending %s.count%s = %llu to graphite",
+			    metric, tags, ss->value.histogram.count);
+		if (!(env->state & STATSD_GRAPHITE_CONNECTED))
 			break;
+		graphite_send_metric(env->graphite_conn, metric,
+		    graphite_tagged(name, sizeof(name), "count", tags),
+		    tv, "%llu", ss->value.histogram.count);
+		graphite_send_metric(env->graphite_conn, metric,
+		    graphite_tagged(name, sizeof(name), "sum", tags),
+		    tv, "%Lf", ss->value.histogram.sum);
+		/* Each bucket counts everything up to its boundary */
+		for (i = 0; i < ss->value.histogram.nbounds; i++) {
+			count += ss->value.histogram.counts[i];
+			graphite_le(le, sizeof(le),
+			    ss->value.histogram.bounds[i]);
+			graphite_send_metric(env->graphite_conn, metric,
+			    graphite_tagged(name, sizeof(name), le, tags),
+			    tv, "%llu", count);
 		}
-
-		free(stat->metric);
-		free(stat);
+		graphite_send_metric(env->graphite_conn, metric,
+		    graphite_tagged(name, sizeof(name), "bucket.le_inf", tags),
+		    tv, "%llu", ss->value.histogram.count);
+		break;
 	default:
-		evhttp_add_header(evhttp_request_get_output_headers(req),
-		    "Allow", "GET, DELETE");
-#if 0
-		/* evhttp_send_error() doesn't appear to honour any
-		 * additional headers set, unlike evhttp_send_reply(). RFC
-		 * states we should send back Allow: header.
-		 */
-		evhttp_send_error(req, HTTP_BADMETHOD, "Bad Method");
-#else
-		evhttp_send_reply(req, HTTP_BADMETHOD, "Bad Method", NULL);
-#endif
 		break;
 	}
 }
 
+/* Serialize at most the given number of statistics from the current
+ * snapshot, returns non-zero if there are still statistics left to send.
+ * Each statistic of the finest interval is merged into the rollups as it
+ * goes, and any rollup whose window that interval completes is sent
+ * straight after it
+ */
+int
+graphite_flush(struct statsd *env, size_t slice)
+{
+	struct snapshot		*snap;
+	struct snapshot_stat	*ss;
+	struct timeval		 t0, t1, tv;
+	size_t			 last;
+
+	gettimeofday(&t0, NULL);
+
+	while ((snap = env->flush) != NULL) {
+		last = snap->next + MIN(slice, snap->count - snap->next);
+		slice -= last - snap->next;
+		for (; snap->next < last; snap->next++) {
+			ss = &snap->stats[snap->next];
+			graphite_flush_stat(env, ss, snap->tv, snap->prefix);
+			if (snap->prefix == NULL)
+				rollup_add(env, ss);
+		}
+		if (snap->next < snap->count)
+			break;
+
+		tv = snap->tv;
+		if (snap->prefix != NULL)
+			snapshot_unref(snap);
+		else
+			graphite_flush_done(env, snap);
+		env->flush = rollup_snapshot(env, tv);
+		if (slice == 0)
+			break;
+	}
+
+	gettimeofday(&t1, NULL);
+
+	timersub(&t1, &t0, &tv);
+	if (timercmp(&tv, &env->flush_slice_tv, >))
+		env->flush_slice_tv = tv;
+	hist_add(&env->hist[HIST_FLUSH_SERIALIZE],
+	    (tv.tv_sec * 1000000000ULL) + (tv.tv_usec * 1000ULL));
+	if (env->graphite_conn->bev != NULL)
+		hist_add(&env->hist[HIST_GRAPHITE_BACKLOG],
+		    evbuffer_get_length(bufferevent_get_output(
+		    env->graphite_conn->bev)));
+
+	return (env->flush != NULL);
+}
+
+/* The finest interval has been sent in full */
 void
-process_counter(struct evhttp_request *req, void *arg)
+graphite_flush_done(struct statsd *env, struct snapshot *snap)
 {
-	process_generic(req, arg, STATSD_COUNTER);
+	uint64_t	 ns;
+
+	ns = hist_now() - env->flush_start;
+	env->flush_tv.tv_sec = ns / 1000000000ULL;
+	env->flush_tv.tv_usec = (ns % 1000000000ULL) / 1000ULL;
+	env->flush = NULL;
+
+	/* This is now the last completed interval */
+	snapshot_publish(env, snap);
+	rollup_tick(env);
 }
 
 void
-process_timer(struct evhttp_request *req, void *arg)
+graphite_flush_cb(int fd, short event, void *arg)
 {
-	process_generic(req, arg, STATSD_TIMER);
+	struct statsd		*env = (struct statsd *)arg;
+	struct timeval		 tv;
+
+	/* Yield back to the event loop between slices so packets can still
+	 * be read while a large table is being flushed
+	 */
+	if (env->flush != NULL && graphite_flush(env, env->graphite_slice)) {
+		timerclear(&tv);
+		evtimer_add(env->flush_ev, &tv);
+	}
 }
 
 void
-process_gauge(struct evhttp_request *req, void *arg)
+graphite_timer_cb(int fd, short event, void *arg)
 {
-	process_generic(req, arg, STATSD_GAUGE);
+	struct statsd		*env = (struct statsd *)arg;
+	struct timeval		 tv;
+	uint64_t		 ns;
+
+	/* Previous flush still hasn't finished, so finish it now rather
+	 * than have two intervals interleaved
+	 */
+	if (env->flush != NULL) {
+		log_warnx("flush overran interval, %zu statistics left",
+		    env->flush->count - env->flush->next);
+		if (evtimer_pending(env->flush_ev, NULL))
+			evtimer_del(env->flush_ev);
+		graphite_flush(env, SIZE_MAX);
+	}
+
+	/* The snapshot may carry a replayed time, so the flush itself is
+	 * timed separately
+	 */
+	env->flush_start = hist_now();
+	aggregate_flush(env);
+	if ((env->flush = snapshot_new(env)) == NULL) {
+		log_warn("snapshot_new");
+		return;
+	}
+
+	/* Taking the snapshot counts as a slice too */
+	ns = hist_now() - env->flush_start;
+	tv.tv_sec = ns / 1000000000ULL;
+	tv.tv_usec = (ns % 1000000000ULL) / 1000ULL;
+	if (timercmp(&tv, &env->flush_slice_tv, >))
+		env->flush_slice_tv = tv;
+	hist_add(&env->hist[HIST_FLUSH_WALK], ns);
+
+	timerclear(&tv);
+	evtimer_add(env->flush_ev, &tv);
 }
 
+/* Carry out commands passed from the HTTP thread */
 void
-process_set(struct evhttp_request *req, void *arg)
+statsd_command_cb(int fd, short event, void *arg)
 {
-	process_generic(req, arg, STATSD_SET);
+	struct statsd		*env = (struct statsd *)arg;
+	struct http_commands	 queue;
+	struct http_command	*cmd;
+	struct statistic	*stat;
+	struct statistic	 find;
+
+	/* Another process has a copy of the statistics, anything deleted
+	 * now would still be there if it takes over
+	 */
+	if (env->upgrade_conn_ev != NULL)
+		return;
+
+	TAILQ_INIT(&queue);
+	pthread_mutex_lock(&env->cmd_mtx);
+	TAILQ_CONCAT(&queue, &env->cmd_queue, entry);
+	pthread_mutex_unlock(&env->cmd_mtx);
+
+	while ((cmd = TAILQ_FIRST(&queue)) != NULL) {
+		TAILQ_REMOVE(&queue, cmd, entry);
+		switch (cmd->op) {
+		case HTTP_COMMAND_DELETE:
+			find.metric = cmd->metric;
+			find.tags = NULL;
+			if ((stat = RB_FIND(type_statistics,
+			    &env->types[cmd->type], &find)) != NULL) {
+				statistic_delete(env, stat);
+				cmd->result = 1;
+			}
+			break;
+		case HTTP_COMMAND_DELETE_PREFIX:
+			cmd->result = statistic_delete_prefix(env, cmd->type,
+			    cmd->metric);
+			break;
+		}
+		http_command_done(env, cmd);
+	}
 }
 
 void
 statsd_read_cb(int fd, short event, void *arg)
 {
-	struct statsd		*env = (struct statsd *)arg;
+	struct listen_addr	*la = (struct listen_addr *)arg;
+	struct statsd		*env = la->env;
 	struct sockaddr_storage	 ss;
 	socklen_t		 slen;
 	ssize_t			 len;
-	char			 storage[STATSD_MAX_UDP_PACKET];
-	char			*ptr, *optr, *nptr;
-	char			*metric = NULL;
-	size_t			 length;
-	struct statistic	 find;
-	struct statistic	*stat;
-	char			*path;
-	double			 value, rate;
-	enum statistic_type	 type;
-	struct timeval		 t0, t1;
-	struct reading		*r1, *r2;
-	struct unique		*u1, *u2;
-	char			*ovalue = NULL;
-
-	bzero(storage, STATSD_MAX_UDP_PACKET);
+	char			 storage[STATSD_MAX_UDP_PACKET + 1];
+
 	slen = sizeof(ss);
-	if ((len = recvfrom(fd, storage, sizeof(storage), 0,
+	if ((len = recvfrom(fd, storage, STATSD_MAX_UDP_PACKET, 0,
 	    (struct sockaddr *)&ss, &slen)) < 1)
 		return;
+	storage[len] = '\0';
 
 	//log_debug("Packet received: \"%s\"", storage);
 	env->bytes_rx += len;
 	env->packets_rx++;
 
-	ptr = storage;
-	while (*ptr != '\0') {
-		/* Maybe check fo allowable characters instead? */
-		if ((length = strcspn(ptr, ":")) == 0) {
-			log_warnx("No metric");
-			goto bad;
-		}
-		metric = calloc(length + 1, sizeof(char));
-		strncpy(metric, ptr, length);
-		ptr += length;
+	if (env->capture != NULL)
+		capture_packet(env, &ss, storage, len);
 
-		if (*ptr != ':') {
-			log_warnx("No ':'");
-			goto bad;
-		}
-		ptr++;
+	statsd_ingest(env, la, &ss, storage);
+}
 
-		/* Remember where the value starts for checking for +/- later */
-		optr = ptr;
-		if (((value = strtod(ptr, &nptr)) == 0) && (nptr == ptr)) {
-			log_warnx("Bad double at %s", ptr);
-			goto bad;
-		}
+int
+listen_addr_cmp(struct listen_addr *la1, struct listen_addr *la2)
+{
+	if (la1->sa.ss_family != la2->sa.ss_family)
+		return (la1->sa.ss_family - la2->sa.ss_family);
+	if (la1->port != la2->port)
+		return (la1->port - la2->port);
+
+	switch (la1->sa.ss_family) {
+	case AF_INET:
+		return (memcmp(&((struct sockaddr_in *)&la1->sa)->sin_addr,
+		    &((struct sockaddr_in *)&la2->sa)->sin_addr,
+		    sizeof(struct in_addr)));
+	case AF_INET6:
+		return (memcmp(&((struct sockaddr_in6 *)&la1->sa)->sin6_addr,
+		    &((struct sockaddr_in6 *)&la2->sa)->sin6_addr,
+		    sizeof(struct in6_addr)));
+	default:
+		return (0);
+	}
+}
 
-		if (*nptr != '|') {
-			log_warnx("No '|'");
-			goto bad;
-		}
+/* Bind the socket for a listen address and start reading from it */
+int
+listen_addr_open(struct statsd *env, struct listen_addr *la)
+{
+	switch (la->sa.ss_family) {
+	case AF_INET:
+		((struct sockaddr_in *)&la->sa)->sin_port = htons(la->port);
+		break;
+	case AF_INET6:
+		((struct sockaddr_in6 *)&la->sa)->sin6_port = htons(la->port);
+		break;
+	default:
+		fatalx("");
+	}
 
-		/* Thanks to the set type, we need the original string value
-		 * to track for uniqueness rather than parsed into a double
-		 */
-		length = nptr - optr;
-		ovalue = calloc(length + 1, sizeof(char));
-		strncpy(ovalue, optr, length);
-
-		ptr = nptr + 1;
-
-		/* Counter, timer, gauge or set? */
-		length = strspn(ptr, "cgms");
-		if (!strncmp(ptr, "c", length)) {
-			type = STATSD_COUNTER;
-		} else if (!strncmp(ptr, "ms", length)) {
-			type = STATSD_TIMER;
-		} else if (!strncmp(ptr, "g", length)) {
-			type = STATSD_GAUGE;
-		} else if (!strncmp(ptr, "s", length)) {
-			type = STATSD_SET;
-		} else {
-			log_warnx("Invalid type");
-			goto bad;
-		}
+	log_info("listening on %s:%hu",
+	    log_sockaddr((struct sockaddr *)&la->sa), la->port);
 
-		ptr += length;
+	/* Already bound if it was handed over by the previous process */
+	if (la->fd != -1)
+		goto done;
 
-		/* Only counters and timers support sample rates */
-		rate = 1;
-		if ((type == STATSD_COUNTER || type == STATSD_TIMER) &&
-		    *ptr == '|') {
-			ptr++;
-			if (*ptr != '@') {
-				log_warnx("No '@'");
-				goto bad;
-			}
-			ptr++;
-			if (((rate = strtod(ptr, &nptr)) == 0) && (nptr == ptr)) {
-				log_warnx("Bad double at %s", ptr);
-				goto bad;
-			}
-			ptr = nptr;
-		}
+	if ((la->fd = socket(la->sa.ss_family, SOCK_DGRAM, 0)) == -1)
+		fatal("socket");
 
-		/* Should now be on either a newline or a null */
-		if (*ptr == '\n')
-			ptr++;
+	if (fcntl(la->fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
 
-		gettimeofday(&t0, NULL);
+	if (bind(la->fd, (struct sockaddr *)&la->sa,
+	    SA_LEN((struct sockaddr *)&la->sa)) == -1) {
+		log_warn("bind on %s failed, skipping",
+		    log_sockaddr((struct sockaddr *)&la->sa));
+		close(la->fd);
+		return (-1);
+	}
 
-		find.metric = metric;
-		stat = RB_FIND(statistics, &env->stats, &find);
+done:
 
-		gettimeofday(&t1, NULL);
+	la->env = env;
+	if ((la->ev = event_new(env->base, la->fd, EV_READ|EV_PERSIST,
+	    statsd_read_cb, (void *)la)) == NULL)
+		fatalx("event_new");
+	event_add(la->ev, NULL);
 
-		/* Track how much time we spend searching for metrics */
-		timersub(&t1, &t0, &t0);
-		timeradd(&env->seek_tv, &t0, &env->seek_tv);
+	return (0);
+}
 
-		/* Same metric name, different type */
-		if (stat && stat->type != type) {
-			log_warnx("Metric %s already exists with different type",
-			    metric);
-			free(metric);
-			free(ovalue);
-			metric = ovalue = NULL;
-			continue;
-		}
+/* Re-read the configuration file and apply whatever changed, the
+ * statistics themselves are left alone
+ */
+void
+statsd_reload(struct statsd *env)
+{
+	struct statsd		*nenv;
+	struct listen_addr	*la, *nla, *next;
+	int			 reconnect;
 
-		env->metrics_rx++;
+	log_info("reloading configuration from %s", env->conffile);
 
-		if (!stat) {
-			stat = calloc(1, sizeof(struct statistic));
-			stat->metric = strdup(metric);
-			stat->type = type;
+	if ((nenv = parse_config(env->conffile, 0)) == NULL) {
+		log_warnx("configuration reload failed, keeping the old one");
+		return;
+	}
 
-			switch (type) {
-			case STATSD_TIMER:
-				RB_INIT(&stat->value.timer.readings);
+	/* Keep the sockets still configured and close the rest */
+	for (la = TAILQ_FIRST(&env->listen_addrs); la != NULL; la = next) {
+		next = TAILQ_NEXT(la, entry);
+		TAILQ_FOREACH(nla, &nenv->listen_addrs, entry)
+			if (listen_addr_cmp(la, nla) == 0)
 				break;
-			case STATSD_SET:
-				RB_INIT(&stat->value.uniques);
-				break;
-			default:
-				break;
-			}
-
-			RB_INSERT(statistics, &env->stats, stat);
-
-			path = calloc(strlen(dispatch[type].path) + strlen(metric) + 3,
-			    sizeof(char));
-			sprintf(path, "/%s/%s", dispatch[type].path, metric);
-			evhttp_set_cb(env->httpd, path, dispatch[type].single_cb,
-			    (void *)env);
-			free(path);
-
-			env->count[type]++;
-		}
-
-		switch (stat->type) {
-		case STATSD_COUNTER:
-			stat->value.count += value * (1 / rate);
-			break;
-		case STATSD_GAUGE:
-			if (*optr == '+' || *optr == '-')
-				stat->value.count += value;
-			else
-				stat->value.count = value;
-			break;
-		case STATSD_TIMER:
-			/* Blame pesky median averages for this */
-			stat->value.timer.count++;
-			r1 = calloc(1, sizeof(struct reading));
-			r1->value = value;
-			r1->count = 1;
-			if ((r2 = RB_INSERT(readings,
-			    &stat->value.timer.readings, r1)) != NULL) {
-				free(r1);
-				r2->count++;
-			}
-			break;
-		case STATSD_SET:
-			u1 = calloc(1, sizeof(struct unique));
-			/* Use the copy of the original value we made */
-			u1->value = ovalue;
-			if ((u2 = RB_INSERT(uniques, &stat->value.uniques,
-			    u1)) != NULL) {
-				log_debug("\"%s\" already in set", value);
-				free(u1->value);
-				free(u1);
-			}
-			break;
-		default:
-			break;
+		if (nla != NULL) {
+			TAILQ_REMOVE(&nenv->listen_addrs, nla, entry);
+			free(nla);
+			continue;
 		}
 
-		/* If this wasn't a set metric, we won't have used this
-		 * copy of the original string value
-		 */
-		if (type != STATSD_SET)
-			free(ovalue);
-		ovalue = NULL;
-
-		/* Record last time this metric was updated */
-		gettimeofday(&stat->tv, NULL);
-
-		free(metric);
+		log_info("no longer listening on %s:%hu",
+		    log_sockaddr((struct sockaddr *)&la->sa), la->port);
+		event_free(la->ev);
+		close(la->fd);
+		TAILQ_REMOVE(&env->listen_addrs, la, entry);
+		free(la);
+	}
 
-		continue;
-bad:
-		if (metric) {
-			free(metric);
-			metric = NULL;
+	/* Anything left over is new */
+	while ((nla = TAILQ_FIRST(&nenv->listen_addrs)) != NULL) {
+		TAILQ_REMOVE(&nenv->listen_addrs, nla, entry);
+		if (listen_addr_open(env, nla) == -1) {
+			free(nla);
+			continue;
 		}
+		TAILQ_INSERT_TAIL(&env->listen_addrs, nla, entry);
+	}
 
-		if (ovalue) {
-			free(ovalue);
-			ovalue = NULL;
+	/* Graphite */
+	reconnect = strcmp(env->graphite_host, nenv->graphite_host) ||
+	    env->graphite_port != nenv->graphite_port ||
+	    timercmp(&env->graphite_reconnect, &nenv->graphite_reconnect, !=);
+	if (reconnect) {
+		graphite_disconnect(env->graphite_conn);
+		graphite_connection_free(env->graphite_conn);
+		free(env->graphite_host);
+		env->graphite_host = nenv->graphite_host;
+		nenv->graphite_host = NULL;
+		env->graphite_port = nenv->graphite_port;
+		env->graphite_reconnect = nenv->graphite_reconnect;
+		if ((env->graphite_conn = graphite_connection_new(
+		    env->graphite_host, env->graphite_port,
+		    env->graphite_reconnect)) == NULL)
+			fatalx("graphite_connection_new");
+		graphite_connection_setcb(env->graphite_conn,
+		    graphite_connect_cb, graphite_disconnect_cb, (void *)env);
+		graphite_connect(env->graphite_conn);
+	}
+	rollup_reload(env, nenv);
+	if (timercmp(&env->graphite_interval, &nenv->graphite_interval, !=)) {
+		env->graphite_interval = nenv->graphite_interval;
+		evtimer_del(env->graphite_ev);
+		if (!env->replay)
+			evtimer_add(env->graphite_ev,
+			    &env->graphite_interval);
+	}
+	env->graphite_slice = nenv->graphite_slice;
+	env->graphite_tags = nenv->graphite_tags;
+	env->max_memory = nenv->max_memory;
+	env->log_limit.rate = nenv->log_limit.rate;
+	env->log_limit.burst = nenv->log_limit.burst;
+
+	/* Histograms */
+	histogram_free(env);
+	TAILQ_CONCAT(&env->histograms, &nenv->histograms, entry);
+
+	/* Limits */
+	limit_free(env);
+	TAILQ_CONCAT(&env->limits, &nenv->limits, entry);
+	limit_index(env);
+
+	/* Rules, which may delete statistics so the limits go first */
+	rule_free(env);
+	TAILQ_CONCAT(&env->rules, &nenv->rules, entry);
+	rule_index(env);
+	aggregate_index(env);
+
+	/* Statistics */
+	reconnect = strcmp(env->stats_host, nenv->stats_host) ||
+	    env->stats_port != nenv->stats_port ||
+	    timercmp(&env->stats_reconnect, &nenv->stats_reconnect, !=);
+	if (reconnect) {
+		graphite_disconnect(env->stats_conn);
+		graphite_connection_free(env->stats_conn);
+		free(env->stats_host);
+		env->stats_host = nenv->stats_host;
+		nenv->stats_host = NULL;
+		env->stats_port = nenv->stats_port;
+		env->stats_reconnect = nenv->stats_reconnect;
+		if ((env->stats_conn = graphite_connection_new(
+		    env->stats_host, env->stats_port,
+		    env->stats_reconnect)) == NULL)
+			fatalx("graphite_connection_new");
+		graphite_connection_setcb(env->stats_conn, stats_connect_cb,
+		    stats_disconnect_cb, (void *)env);
+	}
+	if (timercmp(&env->stats_interval, &nenv->stats_interval, !=)) {
+		env->stats_interval = nenv->stats_interval;
+		if (evtimer_pending(env->stats_ev, NULL)) {
+			evtimer_del(env->stats_ev);
+			evtimer_add(env->stats_ev, &env->stats_interval);
 		}
-
-		/* Try and recover to the next metric in a multi-metric
-		 * packet or just fast-forward to the null at the end
-		 */
-		ptr += strcspn(ptr, "\n");
-		if (*ptr == '\n')
-			ptr++;
 	}
+	if (reconnect)
+		graphite_connect(env->stats_conn);
+	free(env->stats_prefix);
+	env->stats_prefix = nenv->stats_prefix;
+	nenv->stats_prefix = NULL;
+
+	/* Checkpoint */
+	if (env->checkpoint_ev != NULL &&
+	    (nenv->checkpoint_path == NULL ||
+	    timercmp(&env->checkpoint_interval, &nenv->checkpoint_interval,
+	    !=))) {
+		event_free(env->checkpoint_ev);
+		env->checkpoint_ev = NULL;
+	}
+	free(env->checkpoint_path);
+	env->checkpoint_path = nenv->checkpoint_path;
+	nenv->checkpoint_path = NULL;
+	env->checkpoint_interval = nenv->checkpoint_interval;
+	if (env->checkpoint_path != NULL && env->checkpoint_ev == NULL) {
+		env->checkpoint_ev = event_new(env->base, -1, EV_PERSIST,
+		    checkpoint_timer_cb, (void *)env);
+		evtimer_add(env->checkpoint_ev, &env->checkpoint_interval);
+	}
+
+	/* The upgrade socket is only opened at startup */
+	if (nenv->upgrade_path != NULL && (env->upgrade_path == NULL ||
+	    strcmp(env->upgrade_path, nenv->upgrade_path)))
+		log_warnx("upgrade socket can't be changed without a restart");
+
+	/* Anything not moved across above is still owned by nenv */
+	free(nenv->graphite_host);
+	free(nenv->stats_host);
+	free(nenv->stats_prefix);
+	free(nenv->checkpoint_path);
+	free(nenv->upgrade_path);
+	free(nenv);
 }
 
 void
 handle_signal(int sig, short event, void *arg)
 {
+	struct statsd	*env = (struct statsd *)arg;
+
+	if (sig == SIGHUP) {
+		statsd_reload(env);
+		return;
+	}
+	if (sig == SIGCHLD) {
+		checkpoint_reap(env);
+		return;
+	}
+
 	log_info("exiting on signal %d", sig);
 
+	checkpoint_wait(env);
+	if (env->checkpoint_path != NULL && !env->replay &&
+	    checkpoint_write(env, env->checkpoint_path) == 0)
+		log_info("checkpoint written to %s", env->checkpoint_path);
+
+	/* exit(3) flushes whatever is left of the capture */
 	exit(0);
 }
 
@@ -756,17 +825,18 @@ main(int argc, char *argv[])
 	int			 c;
 	int			 debug = 0;
 	int			 noaction = 0;
+	int			 upgrade = 0, verbose = 0, s = -1;
+	int			 paced = 0;
 	const char		*conffile = STATSD_CONF_FILE;
+	const char		*capture = NULL, *replay = NULL;
 	struct event_config	*cfg;
 	struct statsd		*env;
-	int			 i;
-	struct event		*sig_hup, *sig_int, *sig_term;
-	char			*path;
+	struct event		*sig_hup, *sig_int, *sig_term, *sig_chld;
 	struct listen_addr	*la;
 
 	log_init(1);	/* log to stderr until daemonized */
 
-	while ((c = getopt(argc, argv, "df:nv")) != -1) {
+	while ((c = getopt(argc, argv, "df:npr:uvw:")) != -1) {
 		switch (c) {
 		case 'd':
 			debug = 1;
@@ -777,8 +847,20 @@ main(int argc, char *argv[])
 		case 'n':
 			noaction++;
 			break;
+		case 'p':
+			paced = 1;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'u':
+			upgrade = 1;
+			break;
 		case 'v':
-			//flags |= ENQUEUE_F_VERBOSE;
+			verbose = 1;
+			break;
+		case 'w':
+			capture = optarg;
 			break;
 		default:
 			usage();
@@ -788,17 +870,45 @@ main(int argc, char *argv[])
 
 	argc -= optind;
 	argv += optind;
-	if (argc > 0)
+	if (argc > 0 || (replay != NULL && (capture != NULL || upgrade)) ||
+	    (paced && replay == NULL))
 		usage();
 
 	if ((env = parse_config(conffile, 0)) == NULL)
 		exit(1);
+	env->conffile = conffile;
+	env->verbose = verbose;
 
 	if (noaction) {
 		fprintf(stderr, "configuration ok\n");
 		exit(0);
 	}
 
+	env->top[TOP_SOURCES].addresses = 1;
+	env->top[TOP_BAD].addresses = 1;
+
+	/* Publish an empty snapshot until the first flush, this has to
+	 * happen before any statistics are loaded as taking it resets them
+	 */
+	if ((env->published = snapshot_new(env)) == NULL)
+		fatal("snapshot_new");
+
+	limit_index(env);
+	rule_index(env);
+
+	/* A replay starts from nothing and leaves no trace */
+	env->http_fd = -1;
+	if (replay != NULL) {
+		if (replay_open(env, replay, paced) == -1)
+			exit(1);
+	} else if (upgrade) {
+		if (env->upgrade_path == NULL)
+			fatalx("no upgrade socket configured");
+		s = upgrade_receive(env);
+	} else if (env->checkpoint_path != NULL)
+		checkpoint_load(env, env->checkpoint_path);
+	aggregate_index(env);
+
 #if 0
 	if (geteuid())
 		errx(1, "need root privileges");
@@ -807,6 +917,9 @@ main(int argc, char *argv[])
 		errx(1, "unknown user %s", ENQUEUE_USER);
 #endif
 
+	if (capture != NULL && capture_open(env, capture) == -1)
+		exit(1);
+
 	log_init(debug);
 
 	if (!debug) {
@@ -814,6 +927,14 @@ main(int argc, char *argv[])
 			err(1, "failed to daemonize");
 	}
 
+	/* Threads don't survive daemon(3) so only start this now */
+	if (env->log_async)
+		log_async_start();
+
+	/* The HTTP server runs in its own thread */
+	if (evthread_use_pthreads() == -1)
+		fatalx("evthread_use_pthreads");
+
 	if ((cfg = event_config_new()) == NULL)
 		fatalx("event_config_new");
 
@@ -831,68 +952,20 @@ main(int argc, char *argv[])
 	sig_hup = evsignal_new(env->base, SIGHUP, handle_signal, env);
 	sig_int = evsignal_new(env->base, SIGINT, handle_signal, env);
 	sig_term = evsignal_new(env->base, SIGTERM, handle_signal, env);
+	sig_chld = evsignal_new(env->base, SIGCHLD, handle_signal, env);
 	evsignal_add(sig_hup, NULL);
 	evsignal_add(sig_int, NULL);
 	evsignal_add(sig_term, NULL);
-
-	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
-		switch (la->sa.ss_family) {
-		case AF_INET:
-			((struct sockaddr_in *)&la->sa)->sin_port =
-			    htons(la->port);
-			break;
-		case AF_INET6:
-			((struct sockaddr_in6 *)&la->sa)->sin6_port =
-			    htons(la->port);
-			break;
-		default:
-			fatalx("");
-		}
-
-		log_info("listening on %s:%hu",
-		    log_sockaddr((struct sockaddr *)&la->sa), la->port);
-
-		if ((la->fd = socket(la->sa.ss_family, SOCK_DGRAM, 0)) == -1)
-			fatal("socket");
-
-		if (fcntl(la->fd, F_SETFL, O_NONBLOCK) == -1)
-			fatal("fcntl");
-
-		if (bind(la->fd, (struct sockaddr *)&la->sa,
-		    SA_LEN((struct sockaddr *)&la->sa)) == -1) {
-			struct listen_addr	*nla;
-
-			log_warn("bind on %s failed, skipping",
-			    log_sockaddr((struct sockaddr *)&la->sa));
-			close(la->fd);
-			nla = TAILQ_NEXT(la, entry);
-			TAILQ_REMOVE(&env->listen_addrs, la, entry);
-			free(la);
-			la = nla;
-			continue;
-		}
-
-		la = TAILQ_NEXT(la, entry);
-	}
+	evsignal_add(sig_chld, NULL);
 
 	/* HTTP server */
-	if ((env->httpd = evhttp_new(env->base)) == NULL)
-		fatalx("evhttp_new");
-	if (evhttp_bind_socket(env->httpd, "0.0.0.0",
-	    STATSD_DEFAULT_HTTP_PORT) != 0)
-		fatalx("evhttp_bind_socket");
-	/* Only care about GET & DELETE methods */
-	evhttp_set_allowed_methods(env->httpd,
-	    EVHTTP_REQ_GET|EVHTTP_REQ_DELETE);
-	for (i = 0; i < STATSD_MAX_TYPE; i++) {
-		if ((path = calloc(strlen(dispatch[i].path) + 2,
-		    sizeof(char))) == NULL)
-			fatal("calloc");
-		sprintf(path, "/%s", dispatch[i].path);
-		evhttp_set_cb(env->httpd, path, dispatch[i].list_cb,
-		    (void *)env);
-		free(path);
-	}
+	pthread_mutex_init(&env->cmd_mtx, NULL);
+	pthread_mutex_init(&env->snap_mtx, NULL);
+	TAILQ_INIT(&env->cmd_queue);
+	TAILQ_INIT(&env->cmd_done);
+	env->cmd_ev = event_new(env->base, -1, 0, statsd_command_cb,
+	    (void *)env);
+	http_init(env);
 
 	if (graphite_init(env->base) < 0)
 		fatalx("graphite_init");
@@ -903,27 +976,54 @@ main(int argc, char *argv[])
 	    graphite_disconnect_cb, (void *)env);
 	env->graphite_ev = event_new(env->base, -1, EV_PERSIST,
 	    graphite_timer_cb, (void *)env);
-	evtimer_add(env->graphite_ev, &env->graphite_interval);
+	if (!env->replay)
+		evtimer_add(env->graphite_ev, &env->graphite_interval);
+	env->flush_ev = evtimer_new(env->base, graphite_flush_cb, (void *)env);
 	if ((env->stats_conn = graphite_connection_new(env->stats_host,
 	    env->stats_port, env->stats_reconnect)) == NULL)
 		fatalx("graphite_connection_new");
 	graphite_connection_setcb(env->stats_conn, stats_connect_cb,
 	    stats_disconnect_cb, (void *)env);
+
+	if (env->checkpoint_path != NULL && !env->replay) {
+		env->checkpoint_ev = event_new(env->base, -1, EV_PERSIST,
+		    checkpoint_timer_cb, (void *)env);
+		evtimer_add(env->checkpoint_ev, &env->checkpoint_interval);
+	}
 	env->stats_ev = event_new(env->base, -1, EV_PERSIST, stats_timer_cb,
 	    (void *)env);
 
 	log_info("startup");
 
-	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
-		la->ev = event_new(env->base, la->fd, EV_READ|EV_PERSIST,
-		    statsd_read_cb, (void *)env);
-		event_add(la->ev, NULL);
+	for (la = TAILQ_FIRST(&env->listen_addrs); la && !env->replay; ) {
+		if (listen_addr_open(env, la) == -1) {
+			struct listen_addr	*nla;
+
+			nla = TAILQ_NEXT(la, entry);
+			TAILQ_REMOVE(&env->listen_addrs, la, entry);
+			free(la);
+			la = nla;
+			continue;
+		}
+
 		la = TAILQ_NEXT(la, entry);
 	}
 
 	graphite_connect(env->graphite_conn);
 	graphite_connect(env->stats_conn);
 
+	http_start(env);
+
+	/* Only take over the upgrade socket once the old process is done
+	 * with it
+	 */
+	if (s != -1)
+		upgrade_ready(s);
+	if (env->upgrade_path != NULL && !env->replay)
+		upgrade_listen(env);
+	if (env->replay)
+		replay_schedule(env);
+
 	event_base_dispatch(env->base);
 
 	return (0);
@@ -20,10 +20,12 @@
 
 #include <arpa/inet.h>
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
@@ -41,6 +43,33 @@
 
 #define	STATSD_MAX_UDP_PACKET		8192
 
+#define	STATSD_DEFAULT_FLUSH_SLICE	1000
+
+#define	STATSD_HTTP_CHUNK		256
+#define	STATSD_HTTP_MAX_BUCKETS		64
+
+#define	STATSD_TOP_SIZE			64
+#define	STATSD_TOP_BUCKETS		128
+#define	STATSD_TOP_KEYLEN		128
+
+#define	HIST_SUB_BITS			3
+#define	HIST_BUCKETS			((64 - HIST_SUB_BITS + 1) << \
+					    HIST_SUB_BITS)
+
+#define	STATSD_DEFAULT_LOG_RATE		10
+#define	STATSD_DEFAULT_LOG_BURST	50
+
+#define	STATSD_MAX_TAGS			32
+#define	STATSD_TAGSET_BUCKETS		256	/* doubled as it fills */
+
+#define	STATSD_HISTOGRAM_MAX_BOUNDS	64
+
+#define	RULE_MAX_CAPTURES		9	/* $1 to $9 */
+#define	RULE_CACHE_SIZE			8192	/* matched names kept */
+
+#define	STATSD_UPGRADE_MAX_FDS		64
+#define	STATSD_UPGRADE_DRAIN		50	/* x 100ms */
+
 #define	STATSD_GRAPHITE_CONNECTED	(1 << 0)
 
 enum statistic_type {
@@ -48,9 +77,17 @@ enum statistic_type {
 	STATSD_TIMER,
 	STATSD_GAUGE,
 	STATSD_SET,
+	STATSD_HISTOGRAM,
 	STATSD_MAX_TYPE
 };
 
+/* Bytes allocated for each part of a statistic */
+#define	STATISTIC_SIZE(s)	(sizeof(struct statistic) + strlen((s)->metric) + 1)
+#define	READING_SIZE		(sizeof(struct reading))
+#define	UNIQUE_SIZE(u)		(sizeof(struct unique) + strlen((u)->value) + 1)
+#define	HISTOGRAM_SIZE(n)	((n) * sizeof(double) + \
+				    ((n) + 1) * sizeof(unsigned long long))
+
 struct reading {
 	RB_ENTRY(reading)	 entry;
 	int			 count;
@@ -65,11 +102,103 @@ struct unique {
 	char			*value;
 };
 
+enum limit_action {
+	LIMIT_DROP = 0,
+	LIMIT_OVERFLOW
+};
+
+/* Caps how many statistics can exist under a prefix */
+struct limit {
+	TAILQ_ENTRY(limit)	 entry;
+	char			*prefix;
+	char			*overflow;
+	enum limit_action	 action;
+	unsigned long long	 max;
+	unsigned long long	 count;
+	unsigned long long	 dropped;
+};
+
+enum rule_action {
+	RULE_DROP = 0,
+	RULE_REWRITE,
+	RULE_AGGREGATE
+};
+
+enum aggregate_op {
+	AGGREGATE_SUM = 0,
+	AGGREGATE_MAX
+};
+
+/* Drops, renames or aggregates metrics whose names match, see rule.c and
+ * aggregate.c
+ */
+struct rule {
+	TAILQ_ENTRY(rule)	 entry;
+	char			*pattern;
+	char			*replace;	/* or the aggregate's name */
+	enum rule_action	 action;
+	enum aggregate_op	 op;
+	int			 suppress;	/* don't send the members */
+	unsigned int		 index;
+};
+
+/* A name a drop or rewrite rule matched */
+struct rule_cache {
+	char			*metric;
+	char			*name;		/* rewritten to */
+	uint32_t		 hash;
+	struct rule		*rule;
+};
+
+/* Bucket boundaries for histograms whose names match, see histogram.c */
+struct histogram {
+	TAILQ_ENTRY(histogram)	 entry;
+	char			*pattern;
+	double			*bounds;
+	size_t			 nbounds;
+};
+
+/* A canonical set of tags shared by every statistic carrying it, see
+ * tag.c
+ */
+struct tagset {
+	struct tagset		*next;
+	uint32_t		 hash;
+	unsigned int		 id;
+	unsigned int		 refcnt;
+	char			*tags;		/* "key:value,..." */
+};
+
+struct tagsets {
+	struct tagset		**buckets;
+	size_t			 nbuckets;
+	size_t			 count;
+	unsigned int		 last_id;
+};
+
+enum tag_format {
+	TAGS_GRAPHITE = 0,	/* name;key=value */
+	TAGS_PATH		/* name.key.value */
+};
+
+/* Statistics are keyed by name and then tags, untagged ones first */
 struct statistic {
 	RB_ENTRY(statistic)				 entry;
+	RB_ENTRY(statistic)				 type_entry;
 	char						*metric;
+	struct tagset					*tags;
 	struct timeval					 tv;
 	enum statistic_type				 type;
+	size_t						 size;	/* readings, uniques or buckets */
+	struct limit					*limit;
+	/* Aggregates, see aggregate.c. An aggregate is on its own list
+	 * of them by member_entry, as it can't be a member itself
+	 */
+	struct statistic				*aggregate;
+	struct rule					*rule;
+	int						 derived;
+	TAILQ_HEAD(members, statistic)			 members;
+	TAILQ_ENTRY(statistic)				 member_entry;
 	union {
 		long double				 count;
 		struct {
@@ -77,15 +206,204 @@ struct statistic {
 			unsigned long long		 count;
 		}					 timer;
 		RB_HEAD(uniques, unique)		 uniques;
+		struct {
+			double				*bounds;
+			unsigned long long		*counts;
+			size_t				 nbounds;
+			unsigned long long		 count;
+			long double			 sum;
+		}					 histogram;
 	} value;
 };
 
+/* Internal latency histograms, see hist.c */
+enum hist_type {
+	HIST_PARSE = 0,
+	HIST_LOOKUP,
+	HIST_FLUSH_WALK,
+	HIST_FLUSH_SERIALIZE,
+	HIST_GRAPHITE_BACKLOG,
+	HIST_MAX
+};
+
+struct hist {
+	unsigned long long	 buckets[HIST_BUCKETS];
+	unsigned long long	 count;
+	uint64_t		 max;
+};
+
+/* Why a line was rejected, see statsd_read_cb() */
+enum bad_reason {
+	BAD_METRIC = 0,
+	BAD_COLON,
+	BAD_VALUE,
+	BAD_PIPE,
+	BAD_TYPE,
+	BAD_AT,
+	BAD_RATE,
+	BAD_TAGS,
+	BAD_CONFLICT,
+	BAD_MAX
+};
+
+/* One parsed value, the strings point into the packet */
+struct sample {
+	char			*metric;
+	char			*value;
+	char			*tags;		/* as received, or NULL */
+	char			*next;		/* another value on the line */
+	struct statistic	*stat;		/* found for an earlier one */
+	double			 number;
+	double			 rate;
+	enum statistic_type	 type;
+	int			 relative;	/* gauge with a +/- */
+};
+
+/* Heavy hitters, see top.c */
+enum top_type {
+	TOP_METRICS = 0,
+	TOP_SOURCES,
+	TOP_BAD,		/* senders of malformed lines */
+	TOP_MAX
+};
+
+struct top_entry {
+	struct top_entry	*next;
+	unsigned long long	 count;
+	unsigned long long	 error;
+	uint32_t		 hash;
+	int			 heap;
+	size_t			 len;
+	char			 key[STATSD_TOP_KEYLEN];
+};
+
+struct top {
+	int			 addresses;	/* keys are in_addr/in6_addr */
+	int			 count;
+	struct top_entry	*buckets[STATSD_TOP_BUCKETS];
+	struct top_entry	*heap[STATSD_TOP_SIZE];
+	struct top_entry	 entries[STATSD_TOP_SIZE];
+};
+
+struct top_item {
+	char			*key;
+	unsigned long long	 count;
+	unsigned long long	 error;
+};
+
+/* Rejected lines per listening socket, copied for the HTTP thread */
+struct snapshot_listener {
+	char			*name;
+	unsigned long long	 bad[BAD_MAX];
+};
+
+/* A copy of a statistic taken at the start of a flush. Timer readings and
+ * set uniques are moved rather than copied, so taking the snapshot is cheap
+ * regardless of how much data each statistic holds
+ */
+struct snapshot_stat {
+	char						*metric;
+	char						*tags;
+	struct timeval					 tv;
+	enum statistic_type				 type;
+	int						 clash;	/* prometheus.c */
+	union {
+		long double				 count;
+		struct {
+			struct readings			 readings;
+			unsigned long long		 count;
+			long double			 sum;
+			long double			 lower;
+			long double			 upper;
+			long double			 mean;
+		}					 timer;
+		struct {
+			struct uniques			 uniques;
+			unsigned long long		 count;
+		}					 set;
+		struct {
+			double				*bounds;
+			unsigned long long		*counts;
+			size_t				 nbounds;
+			unsigned long long		 count;
+			long double			 sum;
+		}					 histogram;
+	} value;
+};
+
+/* Snapshots are reference counted, the last completed one is kept around
+ * for scraping while HTTP clients may still be streaming an older one
+ */
+struct snapshot {
+	int			 refcnt;
+	struct timeval		 tv;
+	char			*prefix;	/* a rollup's, see rollup.c */
+	int			 clashes;	/* checked for /metrics */
+	struct snapshot_stat	*stats;
+	size_t			 count;
+	size_t			 next;
+	size_t			 size;
+	/* Statistics are grouped by type, each type sorted by name */
+	size_t			 first[STATSD_MAX_TYPE + 1];
+	struct top_item		*top[TOP_MAX];
+	size_t			 ntop[TOP_MAX];
+	unsigned long long	 bad[BAD_MAX];
+	struct snapshot_listener	*listeners;
+	size_t			 nlisteners;
+};
+
+/* A coarser interval built up by merging each snapshot of the finest one
+ * as it is flushed, see rollup.c
+ */
+struct rollup_stat {
+	RB_ENTRY(rollup_stat)	 entry;
+	struct snapshot_stat	 ss;
+};
+
+struct rollup {
+	TAILQ_ENTRY(rollup)			 entry;
+	struct timeval				 interval;
+	char					*prefix;
+	unsigned int				 every;	/* finest intervals */
+	unsigned int				 ticks;
+	int					 due;
+	RB_HEAD(rollup_stats, rollup_stat)	 stats;
+	size_t					 count;
+	size_t					 size;
+};
+
+/* Work the HTTP thread hands to the ingest thread, such as deleting a
+ * statistic, which is handed back with the result to send the reply
+ */
+enum http_command_op {
+	HTTP_COMMAND_DELETE = 0,
+	HTTP_COMMAND_DELETE_PREFIX
+};
+
+struct http_command {
+	TAILQ_ENTRY(http_command)	 entry;
+	struct evhttp_request		*req;
+	enum http_command_op		 op;
+	enum statistic_type		 type;
+	char				*metric;
+	unsigned long long		 result;
+};
+
+TAILQ_HEAD(http_commands, http_command);
+
+struct statistic_dispatch {
+	char	 *path;
+	void	(*list_cb)(struct evhttp_request *, void *);
+};
+
 struct listen_addr {
 	TAILQ_ENTRY(listen_addr)	 entry;
 	struct sockaddr_storage		 sa;
 	int				 port;
 	int				 fd;
 	struct event			*ev;
+	struct statsd			*env;
+	unsigned long long		 bad[BAD_MAX];
 };
 
 struct statsd_addr {
@@ -100,6 +418,12 @@ struct statsd_addr_wrap {
 
 struct statsd {
 	struct event_base			*base;
+	const char				*conffile;
+	int					 verbose;
+
+	/* Warnings about bad input are rate limited */
+	struct log_limit			 log_limit;
+	int					 log_async;
 
 	int					 state;
 
@@ -109,9 +433,16 @@ struct statsd {
 	unsigned short				 graphite_port;
 	struct timeval				 graphite_reconnect;
 	struct timeval				 graphite_interval;
+	unsigned int				 graphite_slice;
+	enum tag_format				 graphite_tags;
 
 	struct graphite_connection		*graphite_conn;
 	struct event				*graphite_ev;
+	struct event				*flush_ev;
+	struct snapshot				*flush;
+	uint64_t				 flush_start;
+	TAILQ_HEAD(rollups, rollup)		 rollups;
+	size_t					 rollup_memory;
 
 	char					*stats_host;
 	unsigned short				 stats_port;
@@ -122,19 +453,226 @@ struct statsd {
 	struct graphite_connection		*stats_conn;
 	struct event				*stats_ev;
 
+	struct event_base			*http_base;
+	pthread_t				 http_tid;
 	struct evhttp				*httpd;
+	int					 http_fd;
+	struct evhttp_bound_socket		*http_bound;
+	struct event				*http_listen_ev;
+	int					 http_listening;
+
+	pthread_mutex_t				 cmd_mtx;
+	struct http_commands			 cmd_queue;
+	struct http_commands			 cmd_done;
+	struct event				*cmd_ev;
+	struct event				*cmd_done_ev;
+
+	/* The snapshot the HTTP thread serves from */
+	pthread_mutex_t				 snap_mtx;
+	struct snapshot				*published;
 
 	RB_HEAD(statistics, statistic)		 stats;
+	/* Same statistics again, indexed by type */
+	RB_HEAD(type_statistics, statistic)	 types[STATSD_MAX_TYPE];
+	struct tagsets				 tagsets;
 
 	/* Statistics */
 	unsigned long long			 bytes_rx;
 	unsigned long long			 packets_rx;
 	unsigned long long			 metrics_rx;
 	unsigned long long			 count[STATSD_MAX_TYPE];
-	struct timeval				 seek_tv;
+	unsigned long long			 seek_ns;
+	unsigned long long			 bad[BAD_MAX];
+	struct hist				 hist[HIST_MAX];
+	struct timeval				 flush_tv;
+	struct timeval				 flush_slice_tv;
+
+	char					*checkpoint_path;
+	struct timeval				 checkpoint_interval;
+	struct event				*checkpoint_ev;
+	struct timeval				 checkpoint_tv;
+	pid_t					 checkpoint_pid;
+	struct timeval				 checkpoint_start;
+
+	/* Bytes held by the statistics, not counting snapshots */
+	size_t					 memory;
+	size_t					 max_memory;
+	unsigned long long			 memory_refused;
+
+	TAILQ_HEAD(histograms, histogram)	 histograms;
+
+	TAILQ_HEAD(rules, rule)			 rules;
+	struct rule_node			*rule_root;
+	struct rule_node			*aggregate_root;
+	struct rule_thread			*rule_threads;
+	size_t					 rule_nodes;
+	unsigned long long			 rule_gen;
+	struct rule_cache			 rule_cache[RULE_CACHE_SIZE];
+	TAILQ_HEAD(aggregates, statistic)	 aggregates;
+	unsigned long long			 rule_dropped;
+	unsigned long long			 rule_rewritten;
+
+	TAILQ_HEAD(limits, limit)		 limits;
+	struct limit_node			*limit_root;
+	unsigned long long			 limit_dropped;
+	unsigned long long			 limit_overflowed;
+
+	/* Busiest metrics and sources this interval */
+	struct top				 top[TOP_MAX];
+
+	char					*upgrade_path;
+	int					 upgrade_fd;
+	struct event				*upgrade_ev;
+	struct event				*upgrade_conn_ev;
+	int					 upgrade_drain;
+
+	/* Packets are written to a capture, or replayed from one with the
+	 * capture's own timestamps as the clock
+	 */
+	FILE					*capture;
+	int					 replay;
+	struct timeval				 clock;
 };
 
+RB_PROTOTYPE(readings, reading, entry, reading_cmp);
+RB_PROTOTYPE(uniques, unique, entry, unique_cmp);
+
+RB_PROTOTYPE(statistics, statistic, entry, statistic_cmp);
+RB_PROTOTYPE(type_statistics, statistic, type_entry, statistic_cmp);
+
 /* prototypes */
+/* core.c */
+extern const char	*bad_names[];
+int		 statistic_cmp(struct statistic *, struct statistic *);
+int		 reading_cmp(struct reading *, struct reading *);
+int		 unique_cmp(struct unique *, struct unique *);
+void		 statsd_env_init(struct statsd *);
+struct statistic	*statistic_new(struct statsd *, const char *,
+		    const char *, enum statistic_type);
+void		 statistic_delete(struct statsd *, struct statistic *);
+void		 statistic_grow(struct statsd *, struct statistic *, size_t);
+void		 statistic_shrink(struct statsd *, struct statistic *, size_t);
+size_t		 statsd_memory(struct statsd *);
+struct statistic	*statistic_nfind(struct statsd *, enum statistic_type,
+		    const char *);
+unsigned long long	 statistic_delete_prefix(struct statsd *,
+		    enum statistic_type, const char *);
+long double	 readings_quantile(struct readings *, unsigned long long,
+		    double);
+struct snapshot	*snapshot_new(struct statsd *);
+void		 snapshot_stat(struct snapshot_stat *, struct statistic *);
+void		 snapshot_stat_free(struct snapshot_stat *);
+struct snapshot	*snapshot_ref(struct snapshot *);
+void		 snapshot_unref(struct snapshot *);
+void		 snapshot_summarise(struct snapshot_stat *);
+void		 statsd_bad(struct statsd *, struct listen_addr *,
+		    struct sockaddr_storage *, enum bad_reason);
+char		*sample_value(char *, struct sample *, enum bad_reason *);
+int		 sample_parse(char *, struct sample *, enum bad_reason *);
+int		 sample_next(struct sample *, enum bad_reason *);
+int		 sample_update(struct statsd *, struct sample *);
+void		 statsd_ingest(struct statsd *, struct listen_addr *,
+		    struct sockaddr_storage *, char *);
+void		 statsd_time(struct statsd *, struct timeval *);
+
+/* statsd.c */
+int		 listen_addr_cmp(struct listen_addr *, struct listen_addr *);
+int		 graphite_flush(struct statsd *, size_t);
+void		 graphite_timer_cb(int, short, void *);
+void		 snapshot_publish(struct statsd *, struct snapshot *);
+struct snapshot	*snapshot_get(struct statsd *);
+
+/* checkpoint.c */
+int		 checkpoint_dump(struct statsd *, FILE *);
+int		 checkpoint_write(struct statsd *, const char *);
+void		 checkpoint_timer_cb(int, short, void *);
+void		 checkpoint_reap(struct statsd *);
+void		 checkpoint_wait(struct statsd *);
+int		 checkpoint_load_fd(struct statsd *, int);
+int		 checkpoint_load(struct statsd *, const char *);
+
+/* limit.c */
+void		 limit_free(struct statsd *);
+void		 limit_index(struct statsd *);
+struct limit	*limit_find(struct statsd *, const char *);
+struct statistic	*limit_overflow(struct statsd *, struct limit *,
+		    enum statistic_type);
+
+/* histogram.c */
+void		 histogram_free(struct statsd *);
+const double	*histogram_find(struct statsd *, const char *, size_t *);
+int		 histogram_bounds(struct statsd *, struct statistic *,
+		    const double *, size_t);
+size_t		 histogram_bucket(const double *, size_t, double);
+
+/* rule.c */
+void		 rule_free(struct statsd *);
+void		 rule_index(struct statsd *);
+struct rule	*rule_find(struct statsd *, struct rule_node *, const char *,
+		    char *, size_t);
+struct rule	*rule_lookup(struct statsd *, const char *, char *, size_t);
+
+/* aggregate.c */
+void		 aggregate_join(struct statsd *, struct statistic *);
+void		 aggregate_leave(struct statsd *, struct statistic *);
+void		 aggregate_index(struct statsd *);
+void		 aggregate_flush(struct statsd *);
+
+/* rollup.c */
+void		 rollup_free(struct statsd *);
+void		 rollup_add(struct statsd *, struct snapshot_stat *);
+void		 rollup_tick(struct statsd *);
+struct snapshot	*rollup_snapshot(struct statsd *, struct timeval);
+void		 rollup_reload(struct statsd *, struct statsd *);
+
+/* hist.c */
+extern const char	*hist_names[];
+uint64_t	 hist_now(void);
+void		 hist_add(struct hist *, uint64_t);
+uint64_t	 hist_quantile(struct hist *, double);
+void		 hist_reset(struct hist *);
+
+/* tag.c */
+int		 tags_valid(const char *, size_t);
+int		 tags_canonical(const char *, char *, size_t);
+struct tagset	*tagset_find(struct statsd *, const char *);
+struct tagset	*tagset_get(struct statsd *, const char *);
+void		 tagset_put(struct statsd *, struct tagset *);
+void		 tags_format(const char *, enum tag_format, char *, size_t);
+
+/* top.c */
+void		 top_reset(struct top *);
+void		 top_update(struct top *, const void *, size_t,
+		    unsigned long long);
+void		 top_update_addr(struct top *, struct sockaddr_storage *,
+		    unsigned long long);
+struct top_item	*top_copy(struct top *, size_t *);
+
+/* capture.c */
+int		 capture_open(struct statsd *, const char *);
+void		 capture_packet(struct statsd *, struct sockaddr_storage *,
+		    const char *, size_t);
+int		 replay_open(struct statsd *, const char *, int);
+void		 replay_schedule(struct statsd *);
+void		 replay_start(struct statsd *);
+
+/* upgrade.c */
+void		 upgrade_listen(struct statsd *);
+int		 upgrade_receive(struct statsd *);
+void		 upgrade_ready(int);
+
+/* http.c */
+extern struct statistic_dispatch	 dispatch[STATSD_MAX_TYPE];
+void		 http_init(struct statsd *);
+void		 http_start(struct statsd *);
+void		 http_listen(struct statsd *, int);
+void		 http_command_send(struct statsd *, struct http_command *);
+void		 http_command_done(struct statsd *, struct http_command *);
+
+/* prometheus.c */
+void		 prometheus_init(void);
+void		 process_prometheus(struct evhttp_request *, void *);
+
 /* parse.y */
 struct statsd	*parse_config(const char *, int);
 int		 host(const char *, struct statsd_addr **);
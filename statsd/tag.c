@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* Tags arrive as DogStatsD sends them, "key:value,key:value", and are
+ * reduced to a canonical form sorted by key then value with duplicates
+ * removed, so the same tags in any order make the same series. Each
+ * distinct set is stored once in a hash table and a statistic is keyed by
+ * its name and the set it points to, so finding one costs a hash of its
+ * tags however many sets there are
+ */
+struct tag {
+	const char	*key;
+	size_t		 klen;
+	const char	*value;
+	size_t		 vlen;
+};
+
+#define	TAGSET_SIZE(ts)	(sizeof(struct tagset) + strlen((ts)->tags) + 1)
+
+int		 tag_reject(const char *, size_t, const char *);
+int		 tag_split(const char *, size_t, struct tag *);
+int		 tag_cmp(struct tag *, struct tag *);
+uint32_t	 tag_hash(const char *);
+void		 tagset_grow(struct statsd *);
+
+/* Graphite won't take some characters in tag names and values */
+int
+tag_reject(const char *p, size_t len, const char *reject)
+{
+	while (len--)
+		if (strchr(reject, *p++) != NULL)
+			return (1);
+
+	return (0);
+}
+
+/* Break up the tags, which needn't be terminated, checking each is a
+ * key and value Graphite will accept. Returns how many there are
+ */
+int
+tag_split(const char *p, size_t len, struct tag *tags)
+{
+	const char	*end = p + len, *next, *colon;
+	int		 n = 0;
+
+	for (; p <= end; p = next + 1) {
+		if ((next = memchr(p, ',', end - p)) == NULL)
+			next = end;
+		if (n == STATSD_MAX_TAGS ||
+		    (colon = memchr(p, ':', next - p)) == NULL ||
+		    colon == p || colon + 1 == next || colon[1] == '~')
+			return (-1);
+		tags[n].key = p;
+		tags[n].klen = colon - p;
+		tags[n].value = colon + 1;
+		tags[n].vlen = next - colon - 1;
+		if (tag_reject(tags[n].key, tags[n].klen, " ;!^=") ||
+		    tag_reject(tags[n].value, tags[n].vlen, " ;"))
+			return (-1);
+		n++;
+	}
+
+	return (n);
+}
+
+int
+tag_cmp(struct tag *t1, struct tag *t2)
+{
+	int	 rv;
+
+	if ((rv = memcmp(t1->key, t2->key, MIN(t1->klen, t2->klen))) != 0)
+		return (rv);
+	if (t1->klen != t2->klen)
+		return ((t1->klen < t2->klen) ? -1 : 1);
+	if ((rv = memcmp(t1->value, t2->value,
+	    MIN(t1->vlen, t2->vlen))) != 0)
+		return (rv);
+	if (t1->vlen != t2->vlen)
+		return ((t1->vlen < t2->vlen) ? -1 : 1);
+
+	return (0);
+}
+
+int
+tags_valid(const char *p, size_t len)
+{
+	struct tag	 tags[STATSD_MAX_TAGS];
+
+	return (tag_split(p, len, tags) > 0);
+}
+
+/* Write the canonical form of the tags into buf, which needs to be at
+ * least as long as they are
+ */
+int
+tags_canonical(const char *p, char *buf, size_t len)
+{
+	struct tag	 tags[STATSD_MAX_TAGS], t;
+	char		*q = buf;
+	int		 i, j, n;
+
+	if ((n = tag_split(p, strlen(p), tags)) < 1 || strlen(p) >= len)
+		return (-1);
+
+	/* There are few enough that an insertion sort is quickest */
+	for (i = 1; i < n; i++) {
+		t = tags[i];
+		for (j = i; j > 0 && tag_cmp(&tags[j - 1], &t) > 0; j--)
+			tags[j] = tags[j - 1];
+		tags[j] = t;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && tag_cmp(&tags[i - 1], &tags[i]) == 0)
+			continue;
+		if (q != buf)
+			*q++ = ',';
+		memcpy(q, tags[i].key, tags[i].klen + 1 + tags[i].vlen);
+		q += tags[i].klen + 1 + tags[i].vlen;
+	}
+	*q = '\0';
+
+	return (0);
+}
+
+uint32_t
+tag_hash(const char *p)
+{
+	uint32_t	 h = 2166136261U;
+
+	/* FNV-1a */
+	while (*p != '\0') {
+		h ^= (unsigned char)*p++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+/* Double the table once it averages more than one set per bucket */
+void
+tagset_grow(struct statsd *env)
+{
+	struct tagsets	*tt = &env->tagsets;
+	struct tagset	**buckets, *ts, *next;
+	size_t		 i, n;
+
+	n = (tt->nbuckets == 0) ? STATSD_TAGSET_BUCKETS : tt->nbuckets * 2;
+	if ((buckets = calloc(n, sizeof(struct tagset *))) == NULL)
+		return;
+
+	for (i = 0; i < tt->nbuckets; i++)
+		for (ts = tt->buckets[i]; ts != NULL; ts = next) {
+			next = ts->next;
+			ts->next = buckets[ts->hash & (n - 1)];
+			buckets[ts->hash & (n - 1)] = ts;
+		}
+
+	env->memory += (n - tt->nbuckets) * sizeof(struct tagset *);
+	free(tt->buckets);
+	tt->buckets = buckets;
+	tt->nbuckets = n;
+}
+
+/* Look up canonical tags, NULL means no statistic carries them */
+struct tagset *
+tagset_find(struct statsd *env, const char *tags)
+{
+	struct tagsets	*tt = &env->tagsets;
+	struct tagset	*ts;
+	uint32_t	 h;
+
+	if (tt->nbuckets == 0)
+		return (NULL);
+
+	h = tag_hash(tags);
+	for (ts = tt->buckets[h & (tt->nbuckets - 1)]; ts != NULL;
+	    ts = ts->next)
+		if (ts->hash == h && !strcmp(ts->tags, tags))
+			return (ts);
+
+	return (NULL);
+}
+
+/* Find or add canonical tags and take a reference to them */
+struct tagset *
+tagset_get(struct statsd *env, const char *tags)
+{
+	struct tagsets	*tt = &env->tagsets;
+	struct tagset	*ts;
+
+	if ((ts = tagset_find(env, tags)) != NULL) {
+		ts->refcnt++;
+		return (ts);
+	}
+
+	if (tt->count >= tt->nbuckets)
+		tagset_grow(env);
+	if (tt->nbuckets == 0)
+		return (NULL);
+
+	if ((ts = calloc(1, sizeof(struct tagset))) == NULL)
+		return (NULL);
+	if ((ts->tags = strdup(tags)) == NULL) {
+		free(ts);
+		return (NULL);
+	}
+	ts->hash = tag_hash(tags);
+	ts->id = ++tt->last_id;
+	ts->refcnt = 1;
+	ts->next = tt->buckets[ts->hash & (tt->nbuckets - 1)];
+	tt->buckets[ts->hash & (tt->nbuckets - 1)] = ts;
+	tt->count++;
+	env->memory += TAGSET_SIZE(ts);
+
+	return (ts);
+}
+
+void
+tagset_put(struct statsd *env, struct tagset *ts)
+{
+	struct tagsets	*tt = &env->tagsets;
+	struct tagset	**tsp;
+
+	if (--ts->refcnt > 0)
+		return;
+
+	for (tsp = &tt->buckets[ts->hash & (tt->nbuckets - 1)]; *tsp != ts;
+	    tsp = &(*tsp)->next)
+		;
+	*tsp = ts->next;
+	tt->count--;
+	env->memory -= TAGSET_SIZE(ts);
+
+	free(ts->tags);
+	free(ts);
+}
+
+/* Canonical tags as they are appended to a Graphite path, either as
+ * Graphite 1.1 ";key=value" tags or as extra ".key.value" components
+ */
+void
+tags_format(const char *tags, enum tag_format format, char *buf,
+    size_t len)
+{
+	const char	*p;
+	size_t		 i = 0;
+	int		 key = 1;
+
+	for (p = tags; *p != '\0' && i + 2 < len; p++) {
+		if (p == tags)
+			buf[i++] = (format == TAGS_PATH) ? '.' : ';';
+		if (*p == ',') {
+			buf[i++] = (format == TAGS_PATH) ? '.' : ';';
+			key = 1;
+		} else if (*p == ':' && key) {
+			buf[i++] = (format == TAGS_PATH) ? '.' : '=';
+			key = 0;
+		} else if (*p == '.' && format == TAGS_PATH)
+			buf[i++] = '_';
+		else
+			buf[i++] = *p;
+	}
+	buf[i] = '\0';
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "statsd.h"
+
+/* Space-Saving: a fixed number of counters, each new key takes over the
+ * smallest one and inherits its count as the possible overestimate. Keys
+ * are found through a small hash table and the smallest counter is kept
+ * at the top of a heap, so an update never costs more than a hash, a
+ * short chain walk and a heap sift no matter how many keys go past
+ */
+
+uint32_t	 top_hash(const void *, size_t);
+void		 top_sift(struct top *, int);
+int		 top_item_cmp(const void *, const void *);
+
+uint32_t
+top_hash(const void *key, size_t len)
+{
+	const unsigned char	*p = key;
+	uint32_t		 h = 2166136261U;
+
+	/* FNV-1a */
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+/* Move an entry whose count has gone up back down the heap */
+void
+top_sift(struct top *top, int i)
+{
+	struct top_entry	*te;
+	int			 c;
+
+	te = top->heap[i];
+	while ((c = (2 * i) + 1) < top->count) {
+		if (c + 1 < top->count &&
+		    top->heap[c + 1]->count < top->heap[c]->count)
+			c++;
+		if (te->count <= top->heap[c]->count)
+			break;
+		top->heap[i] = top->heap[c];
+		top->heap[i]->heap = i;
+		i = c;
+	}
+	top->heap[i] = te;
+	te->heap = i;
+}
+
+void
+top_reset(struct top *top)
+{
+	bzero(top->buckets, sizeof(top->buckets));
+	top->count = 0;
+}
+
+void
+top_update(struct top *top, const void *key, size_t len,
+    unsigned long long n)
+{
+	struct top_entry	*te, **tep;
+	uint32_t		 h;
+	int			 i, p;
+
+	len = MIN(len, STATSD_TOP_KEYLEN);
+	h = top_hash(key, len);
+
+	for (te = top->buckets[h % STATSD_TOP_BUCKETS]; te != NULL;
+	    te = te->next)
+		if (te->hash == h && te->len == len &&
+		    !memcmp(te->key, key, len))
+			break;
+
+	if (te == NULL) {
+		if (top->count < STATSD_TOP_SIZE) {
+			/* Still filling up, with nothing counted yet the
+			 * new entry belongs at the top of the heap
+			 */
+			te = &top->entries[top->count];
+			te->count = te->error = 0;
+			for (i = top->count++; i > 0; i = p) {
+				p = (i - 1) / 2;
+				top->heap[i] = top->heap[p];
+				top->heap[i]->heap = i;
+			}
+			top->heap[0] = te;
+			te->heap = 0;
+		} else {
+			/* Evict the smallest */
+			te = top->heap[0];
+			for (tep = &top->buckets[te->hash %
+			    STATSD_TOP_BUCKETS]; *tep != te;
+			    tep = &(*tep)->next)
+				;
+			*tep = te->next;
+			te->error = te->count;
+		}
+		memcpy(te->key, key, len);
+		te->len = len;
+		te->hash = h;
+		te->next = top->buckets[h % STATSD_TOP_BUCKETS];
+		top->buckets[h % STATSD_TOP_BUCKETS] = te;
+	}
+
+	te->count += n;
+	top_sift(top, te->heap);
+}
+
+/* Senders are keyed on the bare address so every port counts together */
+void
+top_update_addr(struct top *top, struct sockaddr_storage *ss,
+    unsigned long long n)
+{
+	switch (ss->ss_family) {
+	case AF_INET:
+		top_update(top, &((struct sockaddr_in *)ss)->sin_addr,
+		    sizeof(struct in_addr), n);
+		break;
+	case AF_INET6:
+		top_update(top, &((struct sockaddr_in6 *)ss)->sin6_addr,
+		    sizeof(struct in6_addr), n);
+		break;
+	default:
+		break;
+	}
+}
+
+int
+top_item_cmp(const void *a, const void *b)
+{
+	const struct top_item	*t1 = a, *t2 = b;
+
+	if (t1->count != t2->count)
+		return ((t1->count > t2->count) ? -1 : 1);
+	return (strcmp(t1->key, t2->key));
+}
+
+/* Copy the entries out, busiest first, turning address keys into
+ * something readable
+ */
+struct top_item *
+top_copy(struct top *top, size_t *count)
+{
+	struct top_item		*items;
+	struct top_entry	*te;
+	char			 buf[INET6_ADDRSTRLEN];
+	int			 i;
+
+	*count = 0;
+	if (top->count == 0 ||
+	    (items = calloc(top->count, sizeof(struct top_item))) == NULL)
+		return (NULL);
+
+	for (i = 0; i < top->count; i++) {
+		te = &top->entries[i];
+		items[i].count = te->count;
+		items[i].error = te->error;
+		if (!top->addresses)
+			items[i].key = strndup(te->key, te->len);
+		else if (inet_ntop(te->len == sizeof(struct in_addr) ?
+		    AF_INET : AF_INET6, te->key, buf, sizeof(buf)) != NULL)
+			items[i].key = strdup(buf);
+		else
+			items[i].key = strdup("unknown");
+		if (items[i].key == NULL)
+			fatal("strdup");
+	}
+	qsort(items, top->count, sizeof(struct top_item), top_item_cmp);
+
+	*count = top->count;
+	return (items);
+}
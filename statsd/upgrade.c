@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2013 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
+#include "statsd.h"
+
+/* A new process takes over from the running one by connecting to its
+ * upgrade socket. The running process stops reading, finishes any flush
+ * and sends one message carrying the checkpointed statistics, the HTTP
+ * socket and every bound UDP socket. Packets arriving in the meantime
+ * queue up in the shared sockets. Once the new process is reading it
+ * writes a single byte back, and the old process exits as soon as its
+ * graphite output has drained. If the new process goes away without
+ * saying it's ready, the old one carries on as before.
+ */
+struct upgrade_header {
+	uint32_t		 count;
+	uint32_t		 reserved;
+};
+
+struct upgrade_listen {
+	struct sockaddr_storage	 sa;
+	int32_t			 port;
+	int32_t			 reserved;
+};
+
+int		 upgrade_state(struct statsd *);
+void		 upgrade_send(struct statsd *, int);
+void		 upgrade_pause(struct statsd *);
+void		 upgrade_resume(struct statsd *);
+void		 upgrade_accept_cb(int, short, void *);
+void		 upgrade_ready_cb(int, short, void *);
+void		 upgrade_drain_cb(int, short, void *);
+
+/* Checkpoint the statistics to an unlinked temporary file */
+int
+upgrade_state(struct statsd *env)
+{
+	FILE	*fp;
+	char	 path[] = _PATH_TMP "statsd.XXXXXXXXXX";
+	int	 fd, dfd;
+
+	if ((fd = mkstemp(path)) == -1) {
+		log_warn("mkstemp %s", path);
+		return (-1);
+	}
+	unlink(path);
+
+	if ((dfd = dup(fd)) == -1 || (fp = fdopen(dfd, "w")) == NULL) {
+		log_warn("fdopen");
+		if (dfd != -1)
+			close(dfd);
+		close(fd);
+		return (-1);
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	if (checkpoint_dump(env, fp) == -1) {
+		log_warn("checkpoint");
+		fclose(fp);
+		close(fd);
+		return (-1);
+	}
+	fclose(fp);
+
+	return (fd);
+}
+
+void
+upgrade_send(struct statsd *env, int fd)
+{
+	struct upgrade_header	 uh;
+	struct upgrade_listen	 ul[STATSD_UPGRADE_MAX_FDS];
+	struct listen_addr	*la;
+	struct msghdr		 msg;
+	struct cmsghdr		*cmsg;
+	struct iovec		 iov[2];
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int) *
+				    (STATSD_UPGRADE_MAX_FDS + 2))];
+	} cmsgbuf;
+	int			 fds[STATSD_UPGRADE_MAX_FDS + 2];
+	int			 state;
+
+	if ((state = upgrade_state(env)) == -1)
+		return;
+
+	bzero(&uh, sizeof(uh));
+	bzero(ul, sizeof(ul));
+	fds[0] = state;
+	fds[1] = env->http_fd;
+	TAILQ_FOREACH(la, &env->listen_addrs, entry) {
+		if (uh.count == STATSD_UPGRADE_MAX_FDS) {
+			log_warnx("too many listen addresses to hand over");
+			break;
+		}
+		memcpy(&ul[uh.count].sa, &la->sa, sizeof(la->sa));
+		ul[uh.count].port = la->port;
+		fds[2 + uh.count++] = la->fd;
+	}
+
+	iov[0].iov_base = &uh;
+	iov[0].iov_len = sizeof(uh);
+	iov[1].iov_base = ul;
+	iov[1].iov_len = sizeof(struct upgrade_listen) * uh.count;
+
+	bzero(&msg, sizeof(msg));
+	bzero(&cmsgbuf, sizeof(cmsgbuf));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * (uh.count + 2));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (uh.count + 2));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (uh.count + 2));
+
+	if (sendmsg(fd, &msg, 0) == -1)
+		log_warn("sendmsg");
+
+	close(state);
+}
+
+/* Stop touching the statistics while another process has a copy */
+void
+upgrade_pause(struct statsd *env)
+{
+	struct listen_addr	*la;
+
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		event_del(la->ev);
+
+	evtimer_del(env->graphite_ev);
+	if (env->checkpoint_ev != NULL)
+		evtimer_del(env->checkpoint_ev);
+	/* Otherwise it could finish after the new process has written a
+	 * newer one
+	 */
+	checkpoint_wait(env);
+
+	/* Leave new HTTP connections to the other process */
+	http_listen(env, 0);
+
+	/* Whatever was snapshotted has already left the table so it has
+	 * to be sent from here
+	 */
+	if (env->flush != NULL) {
+		evtimer_del(env->flush_ev);
+		graphite_flush(env, SIZE_MAX);
+	}
+}
+
+void
+upgrade_resume(struct statsd *env)
+{
+	struct listen_addr	*la;
+
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		event_add(la->ev, NULL);
+
+	evtimer_add(env->graphite_ev, &env->graphite_interval);
+	if (env->checkpoint_ev != NULL)
+		evtimer_add(env->checkpoint_ev, &env->checkpoint_interval);
+
+	http_listen(env, 1);
+
+	/* Carry out any commands held back while paused */
+	event_active(env->cmd_ev, EV_READ, 0);
+}
+
+void
+upgrade_accept_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	int			 s;
+
+	if ((s = accept(fd, NULL, NULL)) == -1) {
+		log_warn("accept");
+		return;
+	}
+
+	/* Only one upgrade at a time */
+	if (env->upgrade_conn_ev != NULL) {
+		close(s);
+		return;
+	}
+
+	log_info("handing over to new process");
+
+	upgrade_pause(env);
+	upgrade_send(env, s);
+
+	env->upgrade_conn_ev = event_new(env->base, s, EV_READ,
+	    upgrade_ready_cb, (void *)env);
+	event_add(env->upgrade_conn_ev, NULL);
+}
+
+void
+upgrade_ready_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct timeval		 tv;
+	char			 c;
+	ssize_t			 n;
+
+	n = read(fd, &c, sizeof(c));
+
+	event_free(env->upgrade_conn_ev);
+	env->upgrade_conn_ev = NULL;
+	close(fd);
+
+	if (n != sizeof(c)) {
+		log_warnx("new process failed to take over, resuming");
+		upgrade_resume(env);
+		return;
+	}
+
+	/* The socket path now belongs to the new process */
+	event_free(env->upgrade_ev);
+	env->upgrade_ev = NULL;
+	close(env->upgrade_fd);
+	env->upgrade_fd = -1;
+
+	/* Give the last flush a chance to reach graphite */
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	env->upgrade_drain = STATSD_UPGRADE_DRAIN;
+	env->upgrade_conn_ev = evtimer_new(env->base, upgrade_drain_cb,
+	    (void *)env);
+	evtimer_add(env->upgrade_conn_ev, &tv);
+}
+
+void
+upgrade_drain_cb(int fd, short event, void *arg)
+{
+	struct statsd		*env = (struct statsd *)arg;
+	struct timeval		 tv;
+	size_t			 len = 0;
+
+	if (env->graphite_conn->bev != NULL)
+		len = evbuffer_get_length(
+		    bufferevent_get_output(env->graphite_conn->bev));
+
+	if (len > 0 && --env->upgrade_drain > 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		evtimer_add(env->upgrade_conn_ev, &tv);
+		return;
+	}
+
+	if (len > 0)
+		log_warnx("exiting with %zu bytes not sent to graphite", len);
+	log_info("exiting after upgrade");
+
+	exit(0);
+}
+
+/* Listen for a new process wanting to take over */
+void
+upgrade_listen(struct statsd *env)
+{
+	struct sockaddr_un	 sun;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+	    env->upgrade_path) >= (int)sizeof(sun.sun_path))
+		fatalx("upgrade socket path too long");
+
+	if ((env->upgrade_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+
+	/* Any old socket belongs to a process that has handed over or
+	 * gone away
+	 */
+	if (unlink(env->upgrade_path) == -1 && errno != ENOENT)
+		fatal("unlink");
+
+	if (bind(env->upgrade_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("bind");
+	if (listen(env->upgrade_fd, 1) == -1)
+		fatal("listen");
+	if (fcntl(env->upgrade_fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+
+	env->upgrade_ev = event_new(env->base, env->upgrade_fd,
+	    EV_READ|EV_PERSIST, upgrade_accept_cb, (void *)env);
+	event_add(env->upgrade_ev, NULL);
+}
+
+/* Take over the sockets and statistics of the running process, returning
+ * the connection to signal it on once we're reading
+ */
+int
+upgrade_receive(struct statsd *env)
+{
+	struct sockaddr_un	 sun;
+	struct upgrade_header	 uh;
+	struct upgrade_listen	 ul[STATSD_UPGRADE_MAX_FDS];
+	struct listen_addr	*la, ola;
+	struct msghdr		 msg;
+	struct cmsghdr		*cmsg;
+	struct iovec		 iov;
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(int) *
+				    (STATSD_UPGRADE_MAX_FDS + 2))];
+	} cmsgbuf;
+	int			 fds[STATSD_UPGRADE_MAX_FDS + 2];
+	int			 s, nfds = 0, i;
+	size_t			 len;
+	ssize_t			 n;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s",
+	    env->upgrade_path) >= (int)sizeof(sun.sun_path))
+		fatalx("upgrade socket path too long");
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fatal("connect");
+
+	/* The header carries the descriptors and says how many addresses
+	 * follow, only that many are read as the sender then waits for us
+	 */
+	bzero(ul, sizeof(ul));
+	iov.iov_base = &uh;
+	iov.iov_len = sizeof(uh);
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	if ((n = recvmsg(s, &msg, MSG_WAITALL)) == -1)
+		fatal("recvmsg");
+	if ((size_t)n != sizeof(uh) || uh.count > STATSD_UPGRADE_MAX_FDS)
+		fatalx("short upgrade message");
+	if (msg.msg_flags & MSG_CTRUNC)
+		fatalx("upgrade message truncated");
+
+	len = sizeof(struct upgrade_listen) * uh.count;
+	if (len > 0 && ((n = recv(s, ul, len, MSG_WAITALL)) == -1 ||
+	    (size_t)n != len))
+		fatalx("short upgrade message");
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+		}
+	if (nfds != (int)uh.count + 2)
+		fatalx("wrong number of descriptors");
+
+	if (checkpoint_load_fd(env, fds[0]) == -1)
+		fatalx("failed to load statistics");
+	close(fds[0]);
+
+	env->http_fd = fds[1];
+
+	/* Reuse the sockets for any addresses still configured */
+	for (i = 0; i < (int)uh.count; i++) {
+		memcpy(&ola.sa, &ul[i].sa, sizeof(ola.sa));
+		ola.port = ul[i].port;
+		TAILQ_FOREACH(la, &env->listen_addrs, entry)
+			if (la->fd == -1 && listen_addr_cmp(la, &ola) == 0)
+				break;
+		if (la == NULL) {
+			close(fds[2 + i]);
+			continue;
+		}
+		la->fd = fds[2 + i];
+	}
+
+	return (s);
+}
+
+/* Tell the old process we're reading */
+void
+upgrade_ready(int s)
+{
+	char	 c = 0;
+
+	if (write(s, &c, sizeof(c)) != sizeof(c))
+		log_warn("write");
+	close(s);
+}